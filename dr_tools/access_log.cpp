@@ -0,0 +1,176 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "access_log.h"
+
+access_ring_t::access_ring_t(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    slots_.resize(size);
+    mask_ = size - 1;
+}
+
+size_t
+access_ring_t::drain(gzFile file)
+{
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t count = head - tail;
+    // The queued records are at most two contiguous runs of the ring.
+    size_t done = 0;
+    while (done < count) {
+        size_t index = (tail + done) & mask_;
+        size_t run = std::min(count - done, slots_.size() - index);
+        gzwrite(file, &slots_[index], static_cast<unsigned>(run * sizeof(access_record_t)));
+        done += run;
+    }
+    tail_.store(head, std::memory_order_release);
+    return count;
+}
+
+access_log_t::access_log_t(const std::string &dir, size_t ring_capacity)
+    : dir_(dir)
+    , ring_capacity_(ring_capacity)
+    , writer_(&access_log_t::writer_loop, this)
+{
+}
+
+access_log_t::~access_log_t()
+{
+    close();
+}
+
+void
+access_log_t::close()
+{
+    if (!writer_.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lg(mutex_);
+        done_ = true;
+    }
+    wake_.notify_all();
+    writer_.join();
+}
+
+std::string
+access_log_t::prepare_dir() const
+{
+    if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST)
+        return "Failed to create access log directory " + dir_;
+    struct stat info;
+    if (stat(dir_.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) ||
+        access(dir_.c_str(), W_OK) != 0)
+        return "Access log directory " + dir_ + " is not writable";
+    return "";
+}
+
+std::string
+access_log_t::file_name(const std::string &dir, int shard)
+{
+    return dir + "/access." + std::to_string(shard) + ".gz";
+}
+
+access_ring_t *
+access_log_t::open_ring(int shard)
+{
+    // Level 1: the writer has to keep up with the analysis, not win on size.
+    gzFile file = gzopen(file_name(dir_, shard).c_str(), "wb1");
+    if (file == nullptr)
+        return nullptr;
+    std::unique_ptr<stream_t> stream(new stream_t());
+    stream->ring.reset(new access_ring_t(ring_capacity_));
+    stream->file = file;
+    access_ring_t *ring = stream->ring.get();
+    std::lock_guard<std::mutex> lg(mutex_);
+    streams_.push_back(std::move(stream));
+    return ring;
+}
+
+void
+access_log_t::close_ring(access_ring_t *ring)
+{
+    {
+        std::lock_guard<std::mutex> lg(mutex_);
+        for (auto &stream : streams_) {
+            if (stream->ring.get() == ring)
+                stream->closed = true;
+        }
+    }
+    wake_.notify_all();
+}
+
+void
+access_log_t::writer_loop()
+{
+    std::unique_lock<std::mutex> ul(mutex_);
+    while (true) {
+        size_t written = 0;
+        // Producers only push to their rings, so draining needs no lock; the
+        // lock guards the list of streams, which drain() does not touch.
+        std::vector<stream_t *> streams;
+        for (auto &stream : streams_)
+            streams.push_back(stream.get());
+        bool done = done_;
+        ul.unlock();
+        for (stream_t *stream : streams)
+            written += stream->ring->drain(stream->file);
+        ul.lock();
+        // A stream closed before the drain above has nothing left in its ring.
+        for (auto it = streams_.begin(); it != streams_.end();) {
+            stream_t *stream = it->get();
+            bool drained = std::find(streams.begin(), streams.end(), stream) != streams.end();
+            if ((stream->closed || done) && drained) {
+                stream->ring->drain(stream->file);
+                stalls_.fetch_add(stream->ring->stalls(), std::memory_order_relaxed);
+                gzclose(stream->file);
+                it = streams_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (done && streams_.empty())
+            return;
+        if (written == 0)
+            wake_.wait_for(ul, std::chrono::milliseconds(1));
+    }
+}
+
+access_log_reader_t::~access_log_reader_t()
+{
+    if (file_ != nullptr)
+        gzclose(file_);
+}
+
+std::string
+access_log_reader_t::open(const std::string &path)
+{
+    file_ = gzopen(path.c_str(), "rb");
+    if (file_ == nullptr)
+        return "Failed to open " + path;
+    gzbuffer(file_, 1 << 17);
+    return "";
+}
+
+bool
+access_log_reader_t::next(access_record_t &record)
+{
+    if (pos_ == buffer_.size()) {
+        if (file_ == nullptr)
+            return false;
+        buffer_.resize(BUFFER_RECORDS);
+        int bytes = gzread(file_, buffer_.data(),
+                           static_cast<unsigned>(BUFFER_RECORDS * sizeof(access_record_t)));
+        buffer_.resize(bytes > 0 ? bytes / sizeof(access_record_t) : 0);
+        pos_ = 0;
+        if (buffer_.empty())
+            return false;
+    }
+    record = buffer_[pos_++];
+    return true;
+}
@@ -0,0 +1,160 @@
+#ifndef _ACCESS_LOG_H_
+#define _ACCESS_LOG_H_ 1
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+/// One access of the read/write access pattern stream, stored as is (host byte
+/// order) in the compressed per-shard files. Packed to 17 bytes, so neither the
+/// rings nor the files carry padding.
+#pragma pack(push, 1)
+struct access_record_t {
+    /// The access is a store; a load otherwise.
+    static constexpr uint8_t IS_WRITE = 1;
+    /// The previous access of the shard to addr was a store.
+    static constexpr uint8_t LAST_WAS_WRITE = 2;
+
+    uint64_t pc;
+    uint64_t addr;
+    /// IS_WRITE and LAST_WAS_WRITE, as reported by cu_t.
+    uint8_t flags;
+};
+#pragma pack(pop)
+static_assert(sizeof(access_record_t) == 17, "access_record_t must stay packed");
+
+/// Single-producer single-consumer ring of access records. The shard worker is
+/// the producer and never takes a lock; when the ring is full it waits for the
+/// background writer rather than dropping records.
+class access_ring_t {
+public:
+    explicit access_ring_t(size_t capacity);
+
+    inline void
+    push(const access_record_t &record)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        while (head - tail_cache_ >= slots_.size()) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head - tail_cache_ >= slots_.size()) {
+                stalls_.fetch_add(1, std::memory_order_relaxed);
+                std::this_thread::yield();
+            }
+        }
+        slots_[head & mask_] = record;
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    /// Consumer side: writes everything queued so far to file; returns the
+    /// number of records written.
+    size_t
+    drain(gzFile file);
+
+    uint64_t
+    stalls() const
+    {
+        return stalls_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<access_record_t> slots_;
+    size_t mask_;
+    std::atomic<size_t> head_{ 0 };
+    /// Producer's copy of tail_, refreshed only when the ring looks full.
+    size_t tail_cache_ = 0;
+    /// Keeps the producer's and the consumer's index on separate cache lines.
+    char padding_[64];
+    std::atomic<size_t> tail_{ 0 };
+    std::atomic<uint64_t> stalls_{ 0 };
+};
+
+/// Background writer for the access pattern stream. Each shard gets a ring
+/// and a file <dir>/access.<shard>.gz; a single thread drains the rings and
+/// compresses them with zlib.
+class access_log_t {
+public:
+    static constexpr size_t DEFAULT_RING_CAPACITY = 1 << 16;
+
+    explicit access_log_t(const std::string &dir,
+                          size_t ring_capacity = DEFAULT_RING_CAPACITY);
+    /// Calls close().
+    ~access_log_t();
+
+    /// Drains and closes whatever is still open and stops the writer. The
+    /// rings must all have been closed; later calls do nothing.
+    void
+    close();
+
+    /// Creates the directory if needed and checks that it is writable; returns
+    /// an error string or "" on success.
+    std::string
+    prepare_dir() const;
+
+    /// Returns null if the file cannot be created.
+    access_ring_t *
+    open_ring(int shard);
+    /// The ring is flushed and its file closed by the writer thread.
+    void
+    close_ring(access_ring_t *ring);
+
+    static std::string
+    file_name(const std::string &dir, int shard);
+
+    /// Times a producer found its ring full; complete once close() returned.
+    uint64_t
+    stalls() const
+    {
+        return stalls_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct stream_t {
+        std::unique_ptr<access_ring_t> ring;
+        gzFile file;
+        bool closed = false;
+    };
+
+    void
+    writer_loop();
+
+    std::string dir_;
+    size_t ring_capacity_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<std::unique_ptr<stream_t>> streams_;
+    bool done_ = false;
+    std::atomic<uint64_t> stalls_{ 0 };
+    std::thread writer_;
+};
+
+/// Streaming reader of one file written by access_log_t.
+class access_log_reader_t {
+public:
+    access_log_reader_t() = default;
+    ~access_log_reader_t();
+
+    /// Returns an error string or "" on success.
+    std::string
+    open(const std::string &path);
+
+    /// False at the end of the stream.
+    bool
+    next(access_record_t &record);
+
+private:
+    static constexpr size_t BUFFER_RECORDS = 4096;
+
+    gzFile file_ = nullptr;
+    std::vector<access_record_t> buffer_;
+    size_t pos_ = 0;
+};
+
+#endif /* _ACCESS_LOG_H_ */
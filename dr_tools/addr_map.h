@@ -0,0 +1,113 @@
+#ifndef _ADDR_MAP_H_
+#define _ADDR_MAP_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "dr_api.h"
+
+/// Open-addressing map keyed by an address, for the per-shard decode caches and
+/// access histories. Unlike std::unordered_map the slot of a key is computable
+/// without touching memory, so a batch of lookups can be prefetched ahead of
+/// time. The null address is reserved for empty slots.
+template <typename T> class addr_map_t {
+public:
+    explicit addr_map_t(size_t initial_capacity = 1024)
+    {
+        size_t capacity = 16;
+        while (capacity < initial_capacity)
+            capacity <<= 1;
+        slots_.resize(capacity);
+        mask_ = capacity - 1;
+    }
+
+    T *
+    find(app_pc key)
+    {
+        for (size_t index = slot_of(key);; index = (index + 1) & mask_) {
+            slot_t &slot = slots_[index];
+            if (slot.key == key)
+                return &slot.value;
+            if (slot.key == nullptr)
+                return nullptr;
+        }
+    }
+
+    /// Inserts a value-initialized entry for a missing key.
+    T &
+    operator[](app_pc key)
+    {
+        for (size_t index = slot_of(key);; index = (index + 1) & mask_) {
+            slot_t &slot = slots_[index];
+            if (slot.key == key)
+                return slot.value;
+            if (slot.key != nullptr)
+                continue;
+            // Keep the load at most one half so that probe sequences stay short.
+            if (2 * (size_ + 1) > slots_.size()) {
+                grow();
+                return (*this)[key];
+            }
+            slot.key = key;
+            slot.value = T();
+            size_++;
+            return slot.value;
+        }
+    }
+
+    inline void
+    prefetch(app_pc key) const
+    {
+        __builtin_prefetch(&slots_[slot_of(key)]);
+    }
+
+    size_t
+    size() const
+    {
+        return size_;
+    }
+
+    template <typename F>
+    void
+    for_each(F func) const
+    {
+        for (const slot_t &slot : slots_) {
+            if (slot.key != nullptr)
+                func(slot.key, slot.value);
+        }
+    }
+
+private:
+    struct slot_t {
+        app_pc key = nullptr;
+        T value = T();
+    };
+
+    inline size_t
+    slot_of(app_pc key) const
+    {
+        uint64_t hash = reinterpret_cast<uintptr_t>(key) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(hash >> 20) & mask_;
+    }
+
+    void
+    grow()
+    {
+        std::vector<slot_t> old;
+        old.swap(slots_);
+        slots_.resize(old.size() * 2);
+        mask_ = slots_.size() - 1;
+        size_ = 0;
+        for (slot_t &slot : old) {
+            if (slot.key != nullptr)
+                (*this)[slot.key] = slot.value;
+        }
+    }
+
+    std::vector<slot_t> slots_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+};
+
+#endif /* _ADDR_MAP_H_ */
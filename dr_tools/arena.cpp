@@ -0,0 +1,144 @@
+
+#include <sys/mman.h>
+#include "arena.h"
+
+constexpr size_t arena_t::BLOCK_SIZE;
+
+arena_t::stats_t &
+arena_t::stats_t::operator+=(const stats_t &other)
+{
+    allocations += other.allocations;
+    frees += other.frees;
+    reused += other.reused;
+    bytes_requested += other.bytes_requested;
+    bytes_mapped += other.bytes_mapped;
+    blocks += other.blocks;
+    huge_blocks += other.huge_blocks;
+    return *this;
+}
+
+void
+arena_t::stats_t::print(std::ostream &out) const
+{
+    out << "Arena allocations: " << allocations << " (" << reused << " reused, " << frees
+        << " freed), " << bytes_requested << " bytes requested, " << bytes_mapped
+        << " bytes mapped in " << blocks << " blocks (" << huge_blocks << " huge)\n";
+}
+
+arena_t::arena_t(bool huge_pages)
+    : huge_pages_(huge_pages)
+{
+}
+
+arena_t::~arena_t()
+{
+    for (const auto &block : blocks_)
+        munmap(block.first, block.second);
+    for (const auto &large : large_)
+        munmap(large.first, large.second);
+}
+
+size_t
+arena_t::class_of(size_t size, size_t &class_size)
+{
+    if (size <= SMALL_LIMIT) {
+        class_size = size == 0 ? GRANULE : (size + GRANULE - 1) & ~(GRANULE - 1);
+        return class_size / GRANULE;
+    }
+    size_t index = SMALL_LIMIT / GRANULE + 1;
+    class_size = SMALL_LIMIT * 2;
+    while (class_size < size) {
+        class_size <<= 1;
+        index++;
+    }
+    return index;
+}
+
+void *
+arena_t::map(size_t size, bool &huge)
+{
+    void *ptr = MAP_FAILED;
+    huge = false;
+#ifdef MAP_HUGETLB
+    if (huge_pages_ && size % BLOCK_SIZE == 0) {
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = ptr != MAP_FAILED;
+    }
+#endif
+    if (ptr == MAP_FAILED) {
+        // No reserved huge pages: ask for transparent ones instead.
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                   0);
+        if (ptr == MAP_FAILED)
+            throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+        if (huge_pages_)
+            madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    }
+    stats_.bytes_mapped += size;
+    return ptr;
+}
+
+void
+arena_t::new_block()
+{
+    bool huge;
+    cur_ = static_cast<char *>(map(BLOCK_SIZE, huge));
+    end_ = cur_ + BLOCK_SIZE;
+    blocks_.emplace_back(cur_, BLOCK_SIZE);
+    stats_.blocks++;
+    if (huge)
+        stats_.huge_blocks++;
+}
+
+void *
+arena_t::allocate(size_t size, size_t align)
+{
+    stats_.allocations++;
+    stats_.bytes_requested += size;
+    if (size > LARGE_LIMIT) {
+        bool huge;
+        size_t mapped = (size + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+        void *ptr = map(mapped, huge);
+        large_.emplace(ptr, mapped);
+        return ptr;
+    }
+    size_t class_size;
+    size_t index = class_of(size, class_size);
+    if (align <= GRANULE && index < free_lists_.size() && free_lists_[index] != nullptr) {
+        free_chunk_t *chunk = free_lists_[index];
+        free_lists_[index] = chunk->next;
+        stats_.reused++;
+        return chunk;
+    }
+    uintptr_t start = (reinterpret_cast<uintptr_t>(cur_) + align - 1) & ~(align - 1);
+    if (cur_ == nullptr || start + class_size > reinterpret_cast<uintptr_t>(end_)) {
+        new_block();
+        start = (reinterpret_cast<uintptr_t>(cur_) + align - 1) & ~(align - 1);
+    }
+    cur_ = reinterpret_cast<char *>(start + class_size);
+    return reinterpret_cast<void *>(start);
+}
+
+void
+arena_t::deallocate(void *ptr, size_t size)
+{
+    stats_.frees++;
+    if (size > LARGE_LIMIT) {
+        auto iter = large_.find(ptr);
+        if (iter != large_.end()) {
+            munmap(iter->first, iter->second);
+            large_.erase(iter);
+        }
+        return;
+    }
+    size_t class_size;
+    size_t index = class_of(size, class_size);
+    if (index >= free_lists_.size())
+        free_lists_.resize(index + 1, nullptr);
+    free_chunk_t *chunk = static_cast<free_chunk_t *>(ptr);
+    chunk->next = free_lists_[index];
+    free_lists_[index] = chunk;
+}
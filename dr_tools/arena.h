@@ -0,0 +1,156 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <ostream>
+#include <scoped_allocator>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// Pool allocator for analysis-lifetime objects of one shard (or of the global
+/// results). Memory comes from large mmap-ed blocks, optionally backed by huge
+/// pages; freed chunks go to per-size free lists and are reused, and the whole
+/// arena is unmapped at once when it is destroyed. Not thread-safe: an arena
+/// belongs to one shard, or is used under the tool lock.
+class arena_t {
+public:
+    struct stats_t {
+        uint64_t allocations = 0;
+        uint64_t frees = 0;
+        /// Allocations served from a free list.
+        uint64_t reused = 0;
+        uint64_t bytes_requested = 0;
+        uint64_t bytes_mapped = 0;
+        uint64_t blocks = 0;
+        uint64_t huge_blocks = 0;
+
+        stats_t &
+        operator+=(const stats_t &other);
+        /// One line summing up the stats, for the verbose output of the tools.
+        void
+        print(std::ostream &out) const;
+    };
+
+    static constexpr size_t BLOCK_SIZE = size_t(2) << 20;
+
+    explicit arena_t(bool huge_pages = false);
+    ~arena_t();
+    arena_t(const arena_t &) = delete;
+    arena_t &
+    operator=(const arena_t &) = delete;
+
+    void *
+    allocate(size_t size, size_t align);
+    void
+    deallocate(void *ptr, size_t size);
+
+    /// Constructs an object whose destructor never runs: it disappears with the
+    /// arena, together with everything it allocated from the arena.
+    template <typename T, typename... Args>
+    T *
+    make(Args &&...args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    const stats_t &
+    stats() const
+    {
+        return stats_;
+    }
+
+private:
+    static constexpr size_t GRANULE = 16;
+    static constexpr size_t SMALL_LIMIT = 1024;
+    /// Larger requests get a mapping of their own.
+    static constexpr size_t LARGE_LIMIT = BLOCK_SIZE / 4;
+
+    struct free_chunk_t {
+        free_chunk_t *next;
+    };
+
+    /// Size classes: multiples of GRANULE up to SMALL_LIMIT, then powers of two.
+    static size_t
+    class_of(size_t size, size_t &class_size);
+    void *
+    map(size_t size, bool &huge);
+    void
+    new_block();
+
+    bool huge_pages_;
+    char *cur_ = nullptr;
+    char *end_ = nullptr;
+    std::vector<free_chunk_t *> free_lists_;
+    std::vector<std::pair<void *, size_t>> blocks_;
+    std::unordered_map<void *, size_t> large_;
+    stats_t stats_;
+};
+
+/// STL allocator drawing from an arena_t; without an arena it uses the heap.
+template <typename T> class arena_allocator_t {
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    arena_allocator_t() noexcept = default;
+    explicit arena_allocator_t(arena_t *arena) noexcept
+        : arena_(arena)
+    {
+    }
+    template <typename U>
+    arena_allocator_t(const arena_allocator_t<U> &other) noexcept
+        : arena_(other.arena())
+    {
+    }
+
+    T *
+    allocate(size_t n)
+    {
+        if (arena_ == nullptr)
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+    }
+    void
+    deallocate(T *ptr, size_t n)
+    {
+        if (arena_ == nullptr)
+            ::operator delete(ptr);
+        else
+            arena_->deallocate(ptr, n * sizeof(T));
+    }
+
+    arena_t *
+    arena() const noexcept
+    {
+        return arena_;
+    }
+
+private:
+    arena_t *arena_ = nullptr;
+};
+
+template <typename T, typename U>
+inline bool
+operator==(const arena_allocator_t<T> &a, const arena_allocator_t<U> &b)
+{
+    return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+inline bool
+operator!=(const arena_allocator_t<T> &a, const arena_allocator_t<U> &b)
+{
+    return a.arena() != b.arena();
+}
+
+/// For containers of arena-aware elements: the elements are constructed with
+/// the container's arena.
+template <typename T>
+using arena_scoped_allocator_t = std::scoped_allocator_adaptor<arena_allocator_t<T>>;
+
+#endif /* _ARENA_H_ */
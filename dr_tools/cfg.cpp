@@ -3,6 +3,7 @@
 #include "dr_api.h"
 #include "cfg.h"
 #include <algorithm>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <vector>
@@ -12,15 +13,20 @@ const std::string cfg_t::TOOL_NAME = "View tool";
 analysis_tool_t *
 cfg_tool_create(const std::string &module_file_path, uint64_t skip_refs,
                  uint64_t sim_refs, const std::string &syntax, unsigned int verbose,
-                 const std::string &alt_module_dir)
+                 const std::string &alt_module_dir, const std::string &filter,
+                 unsigned int chunk_workers, unsigned int batch_size,
+                 const checkpoint_options_t &checkpoint, bool huge_pages)
 {
     return new cfg_t(module_file_path, skip_refs, sim_refs, syntax, verbose,
-                      alt_module_dir);
+                      alt_module_dir, filter, chunk_workers, batch_size, checkpoint,
+                      huge_pages);
 }
 
 cfg_t::cfg_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t sim_refs,
                const std::string &syntax, unsigned int verbose,
-               const std::string &alt_module_dir)
+               const std::string &alt_module_dir, const std::string &filter,
+               unsigned int chunk_workers, unsigned int batch_size,
+               const checkpoint_options_t &checkpoint, bool huge_pages)
     : module_file_path_(module_file_path)
     , knob_verbose_(verbose)
     , trace_version_(-1)
@@ -28,51 +34,328 @@ cfg_t::cfg_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t s
     , skip_refs_left_(knob_skip_refs_)
     , knob_sim_refs_(sim_refs)
     , sim_refs_left_(knob_sim_refs_)
+    , knob_alt_module_dir_(alt_module_dir)
+    , knob_filter_(filter)
+    , knob_checkpoint_(checkpoint)
+    , checkpoint_trigger_(checkpoint.interval)
+    , knob_huge_pages_(huge_pages)
     , timestamp_(0)
     , has_modules_(true)
+    , global_arena_(huge_pages)
+    , global_bbs(*global_arena_.make<controll_flow_graph>(
+          arena_allocator_t<char>(&global_arena_)))
+    , batcher_(batch_size)
 {
+    if (chunk_workers > 0)
+        pool_.reset(new work_stealing_pool_t(chunk_workers));
 }
 
 std::string
 cfg_t::initialize_stream(memtrace_stream_t *serial_stream)
 {
     serial_stream_ = serial_stream;
-    
+    std::string error = knob_checkpoint_.validate();
+    if (!error.empty())
+        return error;
+    dcontext_.dcontext = dr_standalone_init();
+    error = init_module_filter(filter_, knob_filter_, module_file_path_, knob_verbose_,
+                               knob_alt_module_dir_, directory_, module_mapper_);
+    if (!error.empty())
+        return error;
+    batcher_.select(!filter_.empty());
+    if (!knob_checkpoint_.resume.empty()) {
+        error = load_snapshot(knob_checkpoint_.resume, true);
+        if (!error.empty())
+            return error;
+    }
+    for (const std::string &path : knob_checkpoint_.merge_paths()) {
+        error = load_snapshot(path, false);
+        if (!error.empty())
+            return error;
+    }
     return "";
 }
 
 bool
 cfg_t::parallel_shard_supported()
 {
-    return false;
+    return true;
 }
 
 void *
 cfg_t::parallel_shard_init_stream(int shard_index, void *worker_data,
                                    memtrace_stream_t *shard_stream)
 {
-    return shard_stream;
+    return create_shard(shard_index, shard_stream);
+}
+
+cfg_t::shard_data_t *
+cfg_t::create_shard(int shard_index, memtrace_stream_t *stream)
+{
+    shard_data_t * shard = new shard_data_t(knob_huge_pages_, dcontext_.dcontext);
+    shard->shard_index = shard_index;
+    shard->stream = stream;
+    const std::lock_guard<std::mutex> lg(lock);
+    auto cursor = g_cursors.find(shard_index);
+    if (cursor != g_cursors.end()) {
+        shard->resume_position = cursor->second.position;
+        shard->last_bb_head = cursor->second.head;
+        shard->last_bb_tail = cursor->second.tail;
+        shard->is_new_bb = cursor->second.is_new_bb;
+        shard->bb_instrs = cursor->second.bb_instrs;
+    }
+    return shard;
 }
 // result_graph
 bool
 cfg_t::parallel_shard_exit(void *shard_data)
 {
     shard_data_t * data = reinterpret_cast<shard_data_t *>(shard_data);
-    
-    const std::lock_guard<std::mutex> lg(lock);
-    for (const auto& bb : data->local_bbs) {
-        auto iter = global_bbs.find(bb.first);
+    finish_shard(data);
+    merge_shard(data, record_ordinal(data));
+    delete data;
+    return true;
+}
+
+void
+cfg_t::merge_bbs(controll_flow_graph& into, const controll_flow_graph& from)
+{
+    for (const auto& bb : from) {
+        auto iter = into.find(bb.first);
         
-        if (iter == global_bbs.end()) {
+        if (iter == into.end()) {
             /// If does not exist - create
-            global_bbs.insert(bb);
+            into.insert(bb);
         }else {
             /// If exitst - merge
             for (const auto & e : bb.second.edges) 
                 iter->second.edges.insert(e);
+            iter->second.execution_count += bb.second.execution_count;
+            iter->second.instruction_count =
+                std::max(iter->second.instruction_count, bb.second.instruction_count);
+            if (bb.second.tail != nullptr)
+                iter->second.tail = bb.second.tail;
         }
     }   
-    return true;
+}
+
+void
+cfg_t::merge_shard(shard_data_t * data, uint64_t position)
+{
+    const std::lock_guard<std::mutex> lg(lock);
+    merge_bbs(global_bbs, data->local_bbs);
+    cursor_t &cursor = g_cursors[data->shard_index];
+    cursor.position = position;
+    cursor.head = data->last_bb_head;
+    cursor.tail = data->last_bb_tail;
+    cursor.is_new_bb = data->is_new_bb;
+    cursor.bb_instrs = data->bb_instrs;
+    arena_stats_ += data->arena.stats();
+    arena_stats_ += data->chunk_arena_stats;
+    if (data->chunk_instrs != nullptr)
+        arena_stats_ += data->chunk_instrs->stats();
+}
+
+void
+cfg_t::finish_shard(shard_data_t * shard)
+{
+    if (pool_ != nullptr) {
+        if (shard->open_chunk != nullptr)
+            submit_chunk(shard);
+        pool_->wait(shard->chunk_tasks);
+        stitch_chunks(shard);
+    }
+    batcher_.flush(this, shard);
+    // The last block has no successor, only its tail.
+    if (shard->last_bb_head != nullptr) {
+        basic_block_t &last = shard->local_bbs[shard->last_bb_head];
+        last.tail = shard->last_bb_tail;
+        last.instruction_count = std::max(last.instruction_count, shard->bb_instrs);
+    }
+}
+
+uint64_t
+cfg_t::record_ordinal(const shard_data_t * shard)
+{
+    return shard->stream != nullptr ? shard->stream->get_record_ordinal() : 0;
+}
+
+void
+cfg_t::checkpoint_shard(shard_data_t * shard)
+{
+    bool write = checkpoint_trigger_.add(shard->records_since_poll);
+    shard->records_since_poll = 0;
+    uint64_t epoch = checkpoint_trigger_.epoch();
+    if (!write && shard->checkpoint_epoch == epoch)
+        return;
+    shard->checkpoint_epoch = epoch;
+    // Publish everything before the current record: the merge is additive, so
+    // the local graph can start over while the open block stays the cursor.
+    if (pool_ != nullptr) {
+        if (shard->open_chunk != nullptr)
+            submit_chunk(shard);
+        pool_->wait(shard->chunk_tasks);
+        stitch_chunks(shard);
+    }
+    batcher_.flush(this, shard);
+    uint64_t ordinal = record_ordinal(shard);
+    merge_shard(shard, ordinal > 0 ? ordinal - 1 : 0);
+    shard->local_bbs.clear();
+    if (write)
+        write_checkpoint();
+}
+
+void
+cfg_t::write_checkpoint()
+{
+    // Checkpoints are written one at a time, each from a copy taken in turn, so
+    // the last snapshot written is the latest one.
+    const std::lock_guard<std::mutex> writing(snapshot_lock_);
+    controll_flow_graph bbs;
+    std::unordered_map<int, cursor_t> cursors;
+    {
+        const std::lock_guard<std::mutex> lg(lock);
+        merge_bbs(bbs, global_bbs);
+        cursors = g_cursors;
+    }
+    std::string error = write_snapshot(bbs, cursors);
+    if (!error.empty())
+        std::cerr << "Checkpoint failed: " << error << "\n";
+}
+
+std::string
+cfg_t::write_snapshot(const controll_flow_graph& bbs,
+                      const std::unordered_map<int, cursor_t>& cursors)
+{
+    snapshot_writer_t out(knob_checkpoint_.path, "cfg");
+    out.put(bbs.size());
+    for (const auto& bb : bbs) {
+        out.put_ptr(bb.second.head);
+        out.put_ptr(bb.second.tail);
+        out.put(bb.second.instruction_count);
+        out.put(bb.second.execution_count);
+        out.put(bb.second.edges.size());
+        for (const auto & e : bb.second.edges)
+            out.put_ptr(e);
+    }
+    out.put(cursors.size());
+    for (const auto& cursor : cursors) {
+        out.put(cursor.first);
+        out.put(cursor.second.position);
+        out.put_ptr(cursor.second.head);
+        out.put_ptr(cursor.second.tail);
+        out.put(cursor.second.is_new_bb);
+        out.put(cursor.second.bb_instrs);
+    }
+    return out.commit();
+}
+
+std::string
+cfg_t::load_snapshot(const std::string &path, bool resume)
+{
+    snapshot_reader_t in;
+    std::string error = in.open(path, "cfg");
+    if (!error.empty())
+        return error;
+    controll_flow_graph bbs;
+    for (uint64_t count = in.get(); in.ok() && count > 0; count--) {
+        app_pc head = in.get_ptr<byte>();
+        app_pc tail = in.get_ptr<byte>();
+        basic_block_t bb(head, tail);
+        bb.instruction_count = in.get();
+        bb.execution_count = in.get();
+        for (uint64_t edges = in.get(); in.ok() && edges > 0; edges--)
+            bb.edges.insert(in.get_ptr<byte>());
+        bbs.emplace(bb.head, bb);
+    }
+    std::unordered_map<int, cursor_t> cursors;
+    for (uint64_t count = in.get(); in.ok() && count > 0; count--) {
+        cursor_t &cursor = cursors[static_cast<int>(in.get())];
+        cursor.position = in.get();
+        cursor.head = in.get_ptr<byte>();
+        cursor.tail = in.get_ptr<byte>();
+        cursor.is_new_bb = in.get() != 0;
+        cursor.bb_instrs = in.get();
+    }
+    if (!in.ok())
+        return "Snapshot " + path + " is truncated";
+    merge_bbs(global_bbs, bbs);
+    if (resume)
+        g_cursors = std::move(cursors);
+    return "";
+}
+
+void
+cfg_t::submit_chunk(shard_data_t * shard)
+{
+    chunk_t * chunk = shard->open_chunk;
+    shard->open_chunk = nullptr;
+    pool_->submit(shard->chunk_tasks, [this, chunk]() {
+        parallel_shard_memref_batch(&chunk->state, chunk->records.data(),
+                                    chunk->records.size());
+        std::vector<memref_t>().swap(chunk->records);
+        chunk->done.store(true, std::memory_order_release);
+    });
+    // Bound the buffered chunks, at most CHUNK_BYTES each: rather than reading
+    // ahead, help the workers.
+    while (shard->chunk_tasks.pending() > 2 * pool_->num_workers() && pool_->run_one()) {
+    }
+    // Finished chunks keep only their partial CFG; fold them in as they come.
+    stitch_chunks(shard);
+}
+
+void
+cfg_t::stitch_chunks(shard_data_t * shard)
+{
+    // Walk the chunks in trace order carrying the block that is open across
+    // each boundary, starting from whatever the shard itself had built.
+    app_pc head = shard->last_bb_head;
+    app_pc tail = shard->last_bb_tail;
+    bool is_new_bb = shard->is_new_bb;
+    size_t bb_instrs = shard->bb_instrs;
+    size_t stitched = 0;
+    for (; stitched < shard->chunks.size(); stitched++) {
+        chunk_t * chunk = shard->chunks[stitched].get();
+        if (!chunk->done.load(std::memory_order_acquire))
+            break;
+        shard_data_t &part = chunk->state;
+        shard->chunk_arena_stats += part.arena.stats();
+        if (part.first_pc == nullptr) {
+            is_new_bb = is_new_bb || part.is_new_bb;
+            continue;
+        }
+        // The first pc may come back later as the first block start, so the
+        // prefix is told by its instructions.
+        if (part.prefix_instrs > 0) {
+            if (is_new_bb) {
+                process_new_bb(shard->local_bbs, part.first_pc, head, tail, bb_instrs);
+                head = part.first_pc;
+                bb_instrs = 0;
+            }
+            bb_instrs += part.prefix_instrs;
+            tail = part.first_head != nullptr ? part.prefix_tail : part.last_bb_tail;
+            is_new_bb = part.first_head != nullptr || part.is_new_bb;
+        }
+        if (part.first_head == nullptr)
+            continue;
+        merge_bbs(shard->local_bbs, part.local_bbs);
+        if (head != nullptr) {
+            basic_block_t &prev = shard->local_bbs[head];
+            prev.head = head;
+            prev.tail = tail;
+            prev.edges.insert(part.first_head);
+            prev.instruction_count = std::max(prev.instruction_count, bb_instrs);
+        }
+        head = part.last_bb_head;
+        tail = part.last_bb_tail;
+        is_new_bb = part.is_new_bb;
+        bb_instrs = part.bb_instrs;
+    }
+    shard->chunks.erase(shard->chunks.begin(), shard->chunks.begin() + stitched);
+    shard->last_bb_head = head;
+    shard->last_bb_tail = tail;
+    shard->is_new_bb = is_new_bb;
+    shard->bb_instrs = bb_instrs;
 }
 
 std::string
@@ -86,73 +369,140 @@ cfg_t::parallel_shard_error(void *shard_data)
 bool
 cfg_t::process_memref(const memref_t &memref)
 {
-    
-    return parallel_shard_memref(serial_stream_, memref);
+    shard_data_t *shard = serial_shards_.get(
+        memref.data.tid, [&](int index) { return create_shard(index, serial_stream_); });
+    return parallel_shard_memref(shard, memref);
 }
 
 bool
-cfg_t::process_new_bb(controll_flow_graph& bbs, app_pc trace_pc, app_pc head, app_pc tail) {
-    // Checking that it is not the first bb.
+cfg_t::process_new_bb(controll_flow_graph& bbs, app_pc trace_pc, app_pc head, app_pc tail,
+                      size_t instrs) {
+    // Checking that it is not the first bb, closing it with an edge to the new one.
     if (head) {
-        // Checking that bb exists, otherwise create it.
-        if (bbs.find(head) != bbs.end()) {
-            bbs.emplace(std::make_pair(head, basic_block_t(head, tail)));
-        }
-        bbs[head].edges.insert(trace_pc);
+        basic_block_t &prev = bbs[head];
+        prev.head = head;
+        prev.tail = tail;
+        prev.edges.insert(trace_pc);
+        prev.instruction_count = std::max(prev.instruction_count, instrs);
     }
+    basic_block_t &bb = bbs[trace_pc];
+    bb.head = trace_pc;
+    bb.execution_count++;
     return true;
 }
 
-
 bool
 cfg_t::parallel_shard_memref(void *shard_data, const memref_t &memref)
 {
     shard_data_t * shard = reinterpret_cast<shard_data_t *>(shard_data);
-    
-    if (memref.instr.type == TRACE_MARKER_TYPE_KERNEL_EVENT) {
-        shard->is_new_bb = true;
+    if (shard->resume_position > 0) {
+        if (record_ordinal(shard) <= shard->resume_position)
+            return true;
+        shard->resume_position = 0;
     }
-    if (!type_is_instr(memref.instr.type)) 
-        return true;
-    
-    app_pc decode_pc = const_cast<app_pc>(memref.instr.encoding);
+    if (checkpoint_trigger_.enabled() &&
+        ++shard->records_since_poll >= checkpoint_trigger_.poll_records())
+        checkpoint_shard(shard);
+    if (pool_ == nullptr)
+        return batcher_.add(this, shard, memref);
+
+    if (shard->open_chunk == nullptr) {
+        if (shard->chunk_instrs == nullptr) {
+            shard->chunk_instrs.reset(
+                new shared_instr_cache_t(dcontext_.dcontext, knob_huge_pages_));
+        }
+        shard->chunks.emplace_back(new chunk_t(knob_huge_pages_, *shard->chunk_instrs));
+        shard->open_chunk = shard->chunks.back().get();
+        // Whether the chunk starts a block is only known once it is stitched.
+        shard->open_chunk->state.is_new_bb = false;
+    }
+    shard->open_chunk->records.push_back(memref);
+    if ((memref.marker.type == TRACE_TYPE_MARKER &&
+         memref.marker.marker_type == TRACE_MARKER_TYPE_CHUNK_FOOTER) ||
+        shard->open_chunk->records.size() >= CHUNK_BYTES / sizeof(memref_t))
+        submit_chunk(shard);
+    return true;
+}
+
+bool
+cfg_t::parallel_shard_memref_batch(void *shard_data, const memref_t *memrefs, size_t count)
+{
+    shard_data_t * shard = reinterpret_cast<shard_data_t *>(shard_data);
+    return batcher_.process(this, shard, memrefs, count);
+}
+
+template <bool FILTER>
+bool
+cfg_t::process_batch(shard_data_t * shard, const memref_t *memrefs, size_t count)
+{
+    memref_pipeline_t<FILTER, block_stage_t> pipeline(shard->instr_cache, filter_,
+                                                      shard->filter_cache,
+                                                      block_stage_t(this, shard));
+    pipeline.run(memrefs, count);
+    return true;
+}
+
+void
+cfg_t::process_instr(shard_data_t * shard, const memref_t &memref)
+{
     const app_pc trace_pc = reinterpret_cast<app_pc>(memref.instr.addr);
     bool is_transfer_instruction = false;
     is_transfer_instruction = type_is_instr_branch(memref.instr.type);
 
+    if (shard->first_pc == nullptr)
+        shard->first_pc = trace_pc;
     if (shard->is_new_bb) {
+        if (shard->last_bb_head == nullptr) {
+            shard->first_head = trace_pc;
+            shard->prefix_tail = shard->last_bb_tail;
+        }
         process_new_bb(
               shard->local_bbs
             , trace_pc
             , shard->last_bb_head
             , shard->last_bb_tail
+            , shard->bb_instrs
         );
+        shard->last_bb_head = trace_pc;
         shard->is_new_bb = false;
+        shard->bb_instrs = 0;
     }
     
     if (is_transfer_instruction) {
         shard->is_new_bb = true;
     }
 
-    /// Trying to find this instr in cache. If we haven't met it before, 
-    /// then create it and put into cache and append additional info.
-    auto instr_iter = shard->instr_cache.find(trace_pc);
-    if (instr_iter == shard->instr_cache.end()) {
-        instr_t * instr;
-        instr_init(dcontext_.dcontext, instr);
-        app_pc next_pc =
-            decode_from_copy(dcontext_.dcontext, decode_pc, trace_pc, instr);
-        shard->instr_cache.emplace(trace_pc,  instr);
-        append_additional_info (instr, shard->local_bbs[shard->last_bb_head]);  
-    } 
+    /// The instruction count of a block is that of one of its executions: it
+    /// does not depend on which shard, chunk or run decoded the pcs first.
+    if (shard->last_bb_head == nullptr)
+        shard->prefix_instrs++;
+    else
+        shard->bb_instrs++;
 
     shard->last_bb_tail = trace_pc;
-    return true;
 }
 
 bool
 cfg_t::print_results()
 {
+    serial_shards_.close_all([&](shard_data_t *shard) {
+        finish_shard(shard);
+        merge_shard(shard, record_ordinal(shard));
+    });
+    if (!knob_checkpoint_.path.empty()) {
+        std::string error = write_snapshot(global_bbs, g_cursors);
+        if (!error.empty()) {
+            error_string_ = error;
+            return false;
+        }
+    }
+
+    if (knob_verbose_ > 0) {
+        arena_t::stats_t stats = arena_stats_;
+        stats += global_arena_.stats();
+        stats.print(std::cerr);
+    }
+
     std::ofstream out; 
     out.open("cfg.xml");
     out << "<CFG>\n";
@@ -167,10 +517,10 @@ cfg_t::print_results()
         return res;
     };
 
-    for(auto bb : global_bbs) {
+    for(const auto& bb : global_bbs) {
         auto id = get_id(bb.first);
-        out << "   <BB id=\"" << id << "\" name =\"\" startsaddr=\"" << std::hex <<  bb.second.head << "\" "
-            << "endaddr =\"" << std::hex << bb.second.tail<<"\"\n";
+        out << "   <BB id=\"" << id << "\" name =\"\" startsaddr=\"" << std::hex << static_cast<void *>(bb.second.head) << "\" "
+            << "endaddr =\"" << std::hex << static_cast<void *>(bb.second.tail) <<"\"\n";
         out << "      <instructionsCount>"<< bb.second.instruction_count<<"</instructionsCount>\n";
         out << "      <execution_count>"<< bb.second.execution_count<<"</execution_count>\n";
         out << "      <edges count = \""<< bb.second.edges.size() << "\">";
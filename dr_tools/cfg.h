@@ -2,16 +2,24 @@
 #ifndef _CFG_H_
 #define _CFG_H_ 1
 
+#include <atomic>
 #include <iomanip>
 #include <iostream>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 #include "analysis_tool.h"
+#include "arena.h"
 #include "raw2trace.h"
 #include "raw2trace_directory.h"
+#include "module_filter.h"
+#include "pipeline.h"
+#include "snapshot.h"
+#include "work_stealing_pool.h"
 
 class cfg_t : public analysis_tool_t {
 public:
@@ -21,7 +29,10 @@ public:
     // std::optional here.
     cfg_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t sim_refs,
            const std::string &syntax, unsigned int verbose,
-           const std::string &alt_module_dir = "");
+           const std::string &alt_module_dir = "", const std::string &filter = "",
+           unsigned int chunk_workers = 0, unsigned int batch_size = 0,
+           const checkpoint_options_t &checkpoint = checkpoint_options_t(),
+           bool huge_pages = false);
     std::string
     initialize_stream(memtrace_stream_t *serial_stream) override;
     bool
@@ -33,6 +44,10 @@ public:
     parallel_shard_exit(void *shard_data) override;
     bool
     parallel_shard_memref(void *shard_data, const memref_t &memref) override;
+    /// Processes a span of records of one shard: each window of the span is
+    /// scanned first to prefetch the decode cache entries it will touch.
+    bool
+    parallel_shard_memref_batch(void *shard_data, const memref_t *memrefs, size_t count);
     std::string
     parallel_shard_error(void *shard_data) override;
     bool
@@ -84,6 +99,16 @@ protected:
     uint64_t knob_sim_refs_;
     uint64_t sim_refs_left_;
     bool refs_limited_;
+    std::string knob_alt_module_dir_;
+    /// Spec of the code to track; see module_filter_t.
+    std::string knob_filter_;
+    module_filter_t filter_;
+    /// Workers building the CFG of trace chunks; null unless chunk_workers is set.
+    std::unique_ptr<work_stealing_pool_t> pool_;
+    checkpoint_options_t knob_checkpoint_;
+    checkpoint_trigger_t checkpoint_trigger_;
+    /// Back the arenas with huge pages.
+    bool knob_huge_pages_;
  
     uintptr_t timestamp_;
     int64_t timestamp_record_ord_ = -1;
@@ -98,34 +123,172 @@ protected:
         /// Virtual address of the first and the last instruction in the basic block. 
         app_pc head,tail; 
         /// Outcoming edges from this bb.
-        std::unordered_set<app_pc> edges;
+        std::unordered_set<app_pc, std::hash<app_pc>, std::equal_to<app_pc>,
+                           arena_allocator_t<app_pc>> edges;
         /// Number of instructions in the basic block.
         size_t instruction_count = 0;
         /// How many times this bb was executed
         size_t execution_count = 0;
-        basic_block_t(app_pc _h, app_pc _t) : 
-            head(_h) , tail(_t) { }
-        basic_block_t() : 
-            head(nullptr) , tail(nullptr) { }
+
+        /// The edges live in the arena of the graph holding the bb.
+        using allocator_type = arena_allocator_t<char>;
+        basic_block_t(app_pc _h, app_pc _t, const allocator_type &alloc = allocator_type()) : 
+            head(_h) , tail(_t), edges(alloc) { }
+        explicit basic_block_t(const allocator_type &alloc = allocator_type()) : 
+            head(nullptr) , tail(nullptr), edges(alloc) { }
+        basic_block_t(const basic_block_t &other, const allocator_type &alloc) :
+            head(other.head), tail(other.tail), edges(other.edges, alloc),
+            instruction_count(other.instruction_count),
+            execution_count(other.execution_count) { }
+        basic_block_t(basic_block_t &&other, const allocator_type &alloc) :
+            head(other.head), tail(other.tail), edges(std::move(other.edges), alloc),
+            instruction_count(other.instruction_count),
+            execution_count(other.execution_count) { }
+        basic_block_t(const basic_block_t &) = default;
+        basic_block_t(basic_block_t &&) = default;
     };
-    using controll_flow_graph = std::unordered_map<app_pc, basic_block_t>;
-    controll_flow_graph global_bbs;
+    using controll_flow_graph =
+        std::unordered_map<app_pc, basic_block_t, std::hash<app_pc>, std::equal_to<app_pc>,
+                           arena_scoped_allocator_t<std::pair<const app_pc, basic_block_t>>>;
+    /// The graphs are made in their arena and never destroyed: tearing down the
+    /// arena frees them at once instead of node by node.
+    arena_t global_arena_;
+    controll_flow_graph &global_bbs;
     std::mutex lock;
-    bool process_new_bb(controll_flow_graph& bbs, app_pc trace_pc, app_pc head, app_pc tail);
-    bool append_additional_info(instr_t * instr, basic_block_t& bb);
+    /// Allocator statistics of the exited shards.
+    arena_t::stats_t arena_stats_;
+    /// Where the published state of a shard stands: its records up to the
+    /// record ordinal position are in global_bbs, and the block open there.
+    struct cursor_t {
+        uint64_t position = 0;
+        app_pc head = nullptr;
+        app_pc tail = nullptr;
+        bool is_new_bb = true;
+        size_t bb_instrs = 0;
+    };
+    /// Cursors of the published shards and of the resumed snapshot, by shard index.
+    std::unordered_map<int, cursor_t> g_cursors;
+    /// Held while a checkpoint is written; taken before the lock.
+    std::mutex snapshot_lock_;
+    /// Closes the block at head, which ran instrs instructions this time, with an
+    /// edge to the new block at trace_pc.
+    bool process_new_bb(controll_flow_graph& bbs, app_pc trace_pc, app_pc head, app_pc tail,
+                        size_t instrs);
+    static void merge_bbs(controll_flow_graph& into, const controll_flow_graph& from);
+    std::string write_snapshot(const controll_flow_graph& bbs,
+                               const std::unordered_map<int, cursor_t>& cursors);
+    /// Only a resumed snapshot restores the cursors.
+    std::string load_snapshot(const std::string &path, bool resume);
     
 private:
+    /// Runs the block stage next to the cu stages in a single pass.
+    friend class cfg_cu_t;
+
     static constexpr int RECORD_COLUMN_WIDTH = 12;
     static constexpr int INSTR_COLUMN_WIDTH = 12;
     static constexpr int TID_COLUMN_WIDTH = 11;
     
+    /// A chunk is submitted at a TRACE_MARKER_TYPE_CHUNK_FOOTER or once its
+    /// records take this many bytes, which bounds the records buffered for the
+    /// workers.
+    static constexpr size_t CHUNK_BYTES = size_t(16) << 20;
+
+    struct chunk_t;
     struct shard_data_t {
-        controll_flow_graph local_bbs;
-        std::unordered_map<app_pc, bool> instr_cache;
-        bool is_new_bb;
+        shard_data_t(bool huge_pages, void *dcontext) :
+            arena(huge_pages),
+            local_bbs(*arena.make<controll_flow_graph>(arena_allocator_t<char>(&arena))),
+            instr_cache(dcontext, arena) { }
+        /// State of a chunk, decoding through the instructions of its shard.
+        shard_data_t(bool huge_pages, shared_instr_cache_t &shared) :
+            arena(huge_pages),
+            local_bbs(*arena.make<controll_flow_graph>(arena_allocator_t<char>(&arena))),
+            instr_cache(shared, arena) { }
+        arena_t arena;
+        controll_flow_graph &local_bbs;
+        instr_cache_t instr_cache;
+        std::vector<memref_t> batch;
+        int shard_index = -1;
+        /// Provides the record ordinals that place the shard in the trace.
+        memtrace_stream_t *stream = nullptr;
+        /// Records up to this ordinal were covered by the resumed snapshot.
+        uint64_t resume_position = 0;
+        bool is_new_bb = true;
         app_pc last_bb_head = nullptr;
         app_pc last_bb_tail = nullptr;
+        /// Instructions of the open block run so far.
+        size_t bb_instrs = 0;
+        module_filter_t::cache_t filter_cache;
+        /// A chunk starts in the middle of a block left open by the previous chunk:
+        /// its instructions up to the first block start form the prefix.
+        app_pc first_pc = nullptr;
+        app_pc first_head = nullptr;
+        app_pc prefix_tail = nullptr;
+        size_t prefix_instrs = 0;
+        /// Instructions decoded by the chunks of this shard.
+        std::unique_ptr<shared_instr_cache_t> chunk_instrs;
+        /// Chunks of this shard in trace order not stitched yet, and the one
+        /// being filled.
+        std::vector<std::unique_ptr<chunk_t>> chunks;
+        chunk_t * open_chunk = nullptr;
+        work_stealing_pool_t::task_group_t chunk_tasks;
+        /// Records since the shard last polled checkpoint_trigger_, and the
+        /// epoch of its last publication.
+        uint64_t records_since_poll = 0;
+        uint64_t checkpoint_epoch = 0;
+        /// Allocator statistics of the chunks already stitched.
+        arena_t::stats_t chunk_arena_stats;
+    };
+    /// Consecutive records of a shard and the partial CFG built from them.
+    struct chunk_t {
+        chunk_t(bool huge_pages, shared_instr_cache_t &shared) : state(huge_pages, shared) { }
+        std::vector<memref_t> records;
+        shard_data_t state;
+        /// Set by the worker once state is complete.
+        std::atomic<bool> done{ false };
+    };
+    /// Pipeline stage growing the basic blocks of a shard.
+    struct block_stage_t : public pipeline_stage_t {
+        block_stage_t(cfg_t *tool, shard_data_t *shard) : tool(tool), shard(shard) { }
+        void
+        on_marker(const memref_t &memref)
+        {
+            if (memref.marker.marker_type == TRACE_MARKER_TYPE_KERNEL_EVENT)
+                shard->is_new_bb = true;
+        }
+        void
+        on_excluded(const memref_t &memref)
+        {
+            // Calls into skipped code collapse into an edge to the return site.
+            shard->is_new_bb = true;
+        }
+        void
+        on_instr(const memref_t &memref, instr_t *instr, bool first_seen)
+        {
+            tool->process_instr(shard, memref);
+        }
+        cfg_t *tool;
+        shard_data_t *shard;
     };
+    friend class memref_batcher_t<cfg_t, shard_data_t>;
+    memref_batcher_t<cfg_t, shard_data_t> batcher_;
+    serial_shards_t<shard_data_t> serial_shards_;
+
+    shard_data_t * create_shard(int shard_index, memtrace_stream_t *stream);
+    /// Publishes the shard's records up to the record ordinal position.
+    void merge_shard(shard_data_t * shard, uint64_t position);
+    static uint64_t record_ordinal(const shard_data_t * shard);
+    template <bool FILTER>
+    bool process_batch(shard_data_t * shard, const memref_t *memrefs, size_t count);
+    void process_instr(shard_data_t * shard, const memref_t &memref);
+    void submit_chunk(shard_data_t * shard);
+    void finish_shard(shard_data_t * shard);
+    /// Stitches the leading chunks that are done into the shard.
+    void stitch_chunks(shard_data_t * shard);
+    /// Publishes the shard once per checkpoint epoch and writes the snapshot if
+    /// the shard starts the epoch.
+    void checkpoint_shard(shard_data_t * shard);
+    void write_checkpoint();
 
 };
 
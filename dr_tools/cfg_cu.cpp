@@ -0,0 +1,149 @@
+#include "dr_api.h"
+#include "cfg_cu.h"
+
+analysis_tool_t *
+cfg_cu_tool_create(const std::string &module_file_path, uint64_t skip_refs,
+                   uint64_t sim_refs, const std::string &syntax, unsigned int verbose,
+                   const std::string &alt_module_dir, bool cross_thread,
+                   const std::string &filter, unsigned int batch_size,
+                   const std::string &access_log_dir, bool huge_pages)
+{
+    return new cfg_cu_t(module_file_path, skip_refs, sim_refs, syntax, verbose,
+                        alt_module_dir, cross_thread, filter, batch_size, access_log_dir,
+                        huge_pages);
+}
+
+cfg_cu_t::cfg_cu_t(const std::string &module_file_path, uint64_t skip_refs,
+                   uint64_t sim_refs, const std::string &syntax, unsigned int verbose,
+                   const std::string &alt_module_dir, bool cross_thread,
+                   const std::string &filter, unsigned int batch_size,
+                   const std::string &access_log_dir, bool huge_pages)
+    : cfg_(module_file_path, skip_refs, sim_refs, syntax, verbose, alt_module_dir, "", 0,
+           0, checkpoint_options_t(), huge_pages)
+    , cu_(module_file_path, skip_refs, sim_refs, syntax, verbose, alt_module_dir,
+          cross_thread, filter, 0, access_log_dir, checkpoint_options_t(), huge_pages)
+    , batcher_(batch_size)
+{
+}
+
+std::string
+cfg_cu_t::initialize_stream(memtrace_stream_t *serial_stream)
+{
+    std::string error = cu_.initialize_stream(serial_stream);
+    if (!error.empty())
+        return error;
+    batcher_.select(!cu_.filter_.empty(), cu_.shadow_ != nullptr,
+                    cu_.access_log_ != nullptr);
+    return "";
+}
+
+bool
+cfg_cu_t::parallel_shard_supported()
+{
+    return cu_.parallel_shard_supported();
+}
+
+void *
+cfg_cu_t::parallel_shard_init_stream(int shard_index, void *worker_data,
+                                     memtrace_stream_t *shard_stream)
+{
+    return create_shard(shard_index, shard_stream);
+}
+
+cfg_cu_t::shard_data_t *
+cfg_cu_t::create_shard(int shard_index, memtrace_stream_t *stream)
+{
+    shard_data_t *shard = new shard_data_t;
+    shard->cfg.reset(new cfg_t::shard_data_t(cfg_.knob_huge_pages_, cu_.dcontext_.dcontext));
+    shard->cfg->shard_index = shard_index;
+    shard->cfg->stream = stream;
+    shard->cu.reset(cu_.create_shard(shard_index, stream));
+    return shard;
+}
+
+void
+cfg_cu_t::close_shard(shard_data_t *shard)
+{
+    batcher_.flush(this, shard);
+    cfg_.finish_shard(shard->cfg.get());
+    cfg_.merge_shard(shard->cfg.get(), cfg_t::record_ordinal(shard->cfg.get()));
+    cu_.close_shard(shard->cu.get());
+}
+
+bool
+cfg_cu_t::parallel_shard_exit(void *shard_data)
+{
+    shard_data_t *data = reinterpret_cast<shard_data_t *>(shard_data);
+    close_shard(data);
+    delete data;
+    return true;
+}
+
+std::string
+cfg_cu_t::parallel_shard_error(void *shard_data)
+{
+    shard_data_t *shard = reinterpret_cast<shard_data_t *>(shard_data);
+    if (shard != nullptr && !shard->cu->error.empty())
+        return shard->cu->error;
+    return error_string_;
+}
+
+bool
+cfg_cu_t::process_memref(const memref_t &memref)
+{
+    shard_data_t *shard = serial_shards_.get(
+        memref.data.tid, [&](int index) { return create_shard(index, cu_.serial_stream_); });
+    if (!parallel_shard_memref(shard, memref)) {
+        if (!shard->cu->error.empty())
+            error_string_ = shard->cu->error;
+        return false;
+    }
+    return true;
+}
+
+bool
+cfg_cu_t::parallel_shard_memref(void *shard_data, const memref_t &memref)
+{
+    shard_data_t *shard = reinterpret_cast<shard_data_t *>(shard_data);
+    if (!shard->cu->error.empty())
+        return false;
+    return batcher_.add(this, shard, memref);
+}
+
+bool
+cfg_cu_t::parallel_shard_memref_batch(void *shard_data, const memref_t *memrefs,
+                                      size_t count)
+{
+    shard_data_t *shard = reinterpret_cast<shard_data_t *>(shard_data);
+    return batcher_.process(this, shard, memrefs, count);
+}
+
+template <bool FILTER, bool CROSS_THREAD, bool ACCESS_LOG>
+bool
+cfg_cu_t::process_batch(shard_data_t *shard, const memref_t *memrefs, size_t count)
+{
+    cu_t::shard_data_t *cu = shard->cu.get();
+    memref_pipeline_t<FILTER, cfg_t::block_stage_t, cu_t::dependence_stage_t<ACCESS_LOG>,
+                      optional_stage_t<CROSS_THREAD, cu_t::cross_thread_stage_t>>
+        pipeline(cu->instr_cache, cu_.filter_, cu->filter_cache,
+                 cfg_t::block_stage_t(&cfg_, shard->cfg.get()),
+                 cu_t::dependence_stage_t<ACCESS_LOG>(&cu_, cu),
+                 optional_stage_t<CROSS_THREAD, cu_t::cross_thread_stage_t>(&cu_, cu));
+    pipeline.run(memrefs, count);
+    return true;
+}
+
+bool
+cfg_cu_t::print_results()
+{
+    serial_shards_.close_all([&](shard_data_t *shard) { close_shard(shard); });
+    if (!cfg_.print_results()) {
+        error_string_ = cfg_.error_string_;
+        return false;
+    }
+    if (!cu_.print_results()) {
+        error_string_ = cu_.error_string_;
+        return false;
+    }
+    return true;
+}
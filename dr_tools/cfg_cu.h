@@ -0,0 +1,74 @@
+
+#ifndef _CFG_CU_H_
+#define _CFG_CU_H_ 1
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "analysis_tool.h"
+#include "cfg.h"
+#include "cu.h"
+#include "pipeline.h"
+
+/// Builds the CFG and the CUs of a trace in a single pass: one pipeline runs
+/// the block stage of cfg_t and the stages of cu_t on every record, so the
+/// trace is read, filtered and decoded once for both. The results are those of
+/// the two tools, written by them.
+class cfg_cu_t : public analysis_tool_t {
+public:
+    cfg_cu_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t sim_refs,
+             const std::string &syntax, unsigned int verbose,
+             const std::string &alt_module_dir = "", bool cross_thread = false,
+             const std::string &filter = "", unsigned int batch_size = 0,
+             const std::string &access_log_dir = "", bool huge_pages = false);
+    std::string
+    initialize_stream(memtrace_stream_t *serial_stream) override;
+    bool
+    parallel_shard_supported() override;
+    void *
+    parallel_shard_init_stream(int shard_index, void *worker_data,
+                               memtrace_stream_t *shard_stream) override;
+    bool
+    parallel_shard_exit(void *shard_data) override;
+    bool
+    parallel_shard_memref(void *shard_data, const memref_t &memref) override;
+    bool
+    parallel_shard_memref_batch(void *shard_data, const memref_t *memrefs, size_t count);
+    std::string
+    parallel_shard_error(void *shard_data) override;
+    bool
+    process_memref(const memref_t &memref) override;
+    bool
+    print_results() override;
+
+protected:
+    /// The shards of both tools for one trace shard. The decode cache and the
+    /// filter cache of the cu shard serve both.
+    struct shard_data_t {
+        std::unique_ptr<cfg_t::shard_data_t> cfg;
+        std::unique_ptr<cu_t::shard_data_t> cu;
+        std::vector<memref_t> batch;
+    };
+
+    /// The cu tool owns the DR context, the filter and the optional features;
+    /// the cfg tool only collects the blocks.
+    cfg_t cfg_;
+    cu_t cu_;
+    serial_shards_t<shard_data_t> serial_shards_;
+
+private:
+    friend class memref_batcher_t<cfg_cu_t, shard_data_t>;
+    memref_batcher_t<cfg_cu_t, shard_data_t> batcher_;
+
+    template <bool FILTER, bool CROSS_THREAD, bool ACCESS_LOG>
+    bool
+    process_batch(shard_data_t *shard, const memref_t *memrefs, size_t count);
+    shard_data_t *
+    create_shard(int shard_index, memtrace_stream_t *stream);
+    void
+    close_shard(shard_data_t *shard);
+};
+
+#endif /* _CFG_CU_H_ */
@@ -1,6 +1,7 @@
 
 
 #include <algorithm>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <vector>
@@ -12,15 +13,22 @@ const std::string cu_t::TOOL_NAME = "CU tool";
 analysis_tool_t *
 cu_tool_create(const std::string &module_file_path, uint64_t skip_refs,
                  uint64_t sim_refs, const std::string &syntax, unsigned int verbose,
-                 const std::string &alt_module_dir)
+                 const std::string &alt_module_dir, bool cross_thread,
+                 const std::string &filter, unsigned int batch_size,
+                 const std::string &access_log_dir, const checkpoint_options_t &checkpoint,
+                 bool huge_pages)
 {
     return new cu_t(module_file_path, skip_refs, sim_refs, syntax, verbose,
-                      alt_module_dir);
+                      alt_module_dir, cross_thread, filter, batch_size, access_log_dir,
+                      checkpoint, huge_pages);
 }
 
 cu_t::cu_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t sim_refs,
                const std::string &syntax, unsigned int verbose,
-               const std::string &alt_module_dir)
+               const std::string &alt_module_dir, bool cross_thread,
+               const std::string &filter, unsigned int batch_size,
+               const std::string &access_log_dir, const checkpoint_options_t &checkpoint,
+               bool huge_pages)
     : module_file_path_(module_file_path)
     , knob_verbose_(verbose)
     , trace_version_(-1)
@@ -35,54 +43,332 @@ cu_t::cu_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t sim
     , filetype_(-1)
     , timestamp_(0)
     , has_modules_(true)
+    , knob_cross_thread_(cross_thread)
+    , knob_filter_(filter)
+    , knob_access_log_dir_(access_log_dir)
+    , knob_checkpoint_(checkpoint)
+    , checkpoint_trigger_(checkpoint.interval)
+    , knob_huge_pages_(huge_pages)
+    , global_arena_(huge_pages)
+    , g_cus(*global_arena_.make<cus_t>(arena_allocator_t<char>(&global_arena_)))
+    , batcher_(batch_size)
 {
+    if (knob_cross_thread_)
+        shadow_.reset(new shadow_memory_t());
+    if (!knob_access_log_dir_.empty())
+        access_log_.reset(new access_log_t(knob_access_log_dir_));
 }
 
 std::string
 cu_t::initialize_stream(memtrace_stream_t *serial_stream)
 {
     serial_stream_ = serial_stream;
-    return "cu";    
+    std::string error = knob_checkpoint_.validate();
+    if (!error.empty())
+        return error;
+    dcontext_.dcontext = dr_standalone_init();
+    error = init_module_filter(filter_, knob_filter_, module_file_path_, knob_verbose_,
+                               knob_alt_module_dir_, directory_, module_mapper_);
+    if (!error.empty())
+        return error;
+    if (access_log_ != nullptr) {
+        error = access_log_->prepare_dir();
+        if (!error.empty())
+            return error;
+    }
+    batcher_.select(!filter_.empty(), shadow_ != nullptr, access_log_ != nullptr);
+    if (!knob_checkpoint_.resume.empty()) {
+        error = load_snapshot(knob_checkpoint_.resume, true);
+        if (!error.empty())
+            return error;
+    }
+    for (const std::string &path : knob_checkpoint_.merge_paths()) {
+        error = load_snapshot(path, false);
+        if (!error.empty())
+            return error;
+    }
+    return "";
 }
 
 bool
 cu_t::parallel_shard_supported()
 {
-    return false;
+    // The cross-thread mode needs the shards: the shadow memory is shared between
+    // them and trace timestamps order the accesses of different threads.
+    return knob_cross_thread_;
 }
 
 void *
 cu_t::parallel_shard_init_stream(int shard_index, void *worker_data,
                                    memtrace_stream_t *shard_stream)
 {
-    return shard_stream;
+    return create_shard(shard_index, shard_stream);
+}
+
+cu_t::shard_data_t *
+cu_t::create_shard(int shard_index, memtrace_stream_t *stream)
+{
+    shard_data_t * shard = new shard_data_t(knob_huge_pages_, dcontext_.dcontext);
+    shard->shard_index = shard_index;
+    shard->stream = stream;
+    shard->cus_count = first_cu(shard_index);
+    {
+        const std::lock_guard<std::mutex> lg(lock);
+        auto cursor = g_cursors.find(shard_index);
+        if (cursor != g_cursors.end()) {
+            shard->resume_position = cursor->second.position;
+            shard->cus_count = cursor->second.cus_count;
+        }
+        auto iter = g_history.find(shard_index);
+        if (iter != g_history.end()) {
+            shard->reg_history = iter->second.reg_history;
+            shard->mem_history = iter->second.mem_history;
+            shard->last_is_write = iter->second.last_is_write;
+        }
+    }
+    if (access_log_ != nullptr) {
+        shard->access_ring = access_log_->open_ring(shard_index);
+        if (shard->access_ring == nullptr) {
+            shard->error = "Failed to create " +
+                access_log_t::file_name(knob_access_log_dir_, shard_index);
+        }
+    }
+    return shard;
+}
+
+void
+cu_t::close_shard(shard_data_t * shard)
+{
+    batcher_.flush(this, shard);
+    if (shard->access_ring != nullptr) {
+        access_log_->close_ring(shard->access_ring);
+        shard->access_ring = nullptr;
+    }
+    merge_shard(shard, record_ordinal(shard));
+    const std::lock_guard<std::mutex> lg(lock);
+    arena_stats_ += shard->arena.stats();
 }
 // result_graph
 bool
 cu_t::parallel_shard_exit(void *shard_data)
 {
     shard_data_t * data = reinterpret_cast<shard_data_t *>(shard_data);
-    
-    const std::lock_guard<std::mutex> lg(lock);
-    for (const auto& cu : data->cus) {
-        auto iter = g_cus.find(cu.first);
+    close_shard(data);
+    delete data;
+    return true;
+}
+
+void
+cu_t::merge_cus(cus_t& into, const cus_t& from)
+{
+    for (const auto& cu : from) {
+        auto iter = into.find(cu.first);
         
-        if (iter == g_cus.end()) {
+        if (iter == into.end()) {
             /// If does not exist - create
-            g_cus.insert(cu);
+            into.insert(cu);
         }else {
             /// If exitst - merge
             for (const auto & e : cu.second.successors) 
                 iter->second.successors.insert(e);
+            for (const auto & i : cu.second.instructions) 
+                iter->second.instructions.insert(i);
+            iter->second.readDataSize += cu.second.readDataSize;
+            iter->second.writeDataSize += cu.second.writeDataSize;
         }
     }   
-    
-    return true;
+}
+
+void
+cu_t::merge_shard(shard_data_t * data, uint64_t position)
+{
+    const std::lock_guard<std::mutex> lg(lock);
+    for (const auto& dep : data->cross_deps)
+        g_cross_deps[dep.first] += dep.second;
+    if (data->tid != -1)
+        g_shard_tids[data->shard_index] = data->tid;
+    merge_cus(g_cus, data->cus);
+    cursor_t &cursor = g_cursors[data->shard_index];
+    cursor.position = position;
+    cursor.cus_count = data->cus_count;
+    if (knob_checkpoint_.history) {
+        history_t &history = g_history[data->shard_index];
+        history.reg_history = data->reg_history;
+        history.mem_history = data->mem_history;
+        history.last_is_write = data->last_is_write;
+    }
+}
+
+uint64_t
+cu_t::record_ordinal(const shard_data_t * shard)
+{
+    return shard->stream != nullptr ? shard->stream->get_record_ordinal() : 0;
+}
+
+void
+cu_t::checkpoint_shard(shard_data_t * shard)
+{
+    bool write = checkpoint_trigger_.add(shard->records_since_poll);
+    shard->records_since_poll = 0;
+    uint64_t epoch = checkpoint_trigger_.epoch();
+    if (!write && shard->checkpoint_epoch == epoch)
+        return;
+    shard->checkpoint_epoch = epoch;
+    // Publish everything before the current record, an instruction: the pending
+    // one has all its data refs. The merge is additive, so the shard starts
+    // over with only its dependence history.
+    batcher_.flush(this, shard);
+    if (access_log_ != nullptr)
+        process_old_reference<true>(shard, shard->current_instr);
+    else
+        process_old_reference<false>(shard, shard->current_instr);
+    shard->current_instr = nullptr;
+    uint64_t ordinal = record_ordinal(shard);
+    merge_shard(shard, ordinal > 0 ? ordinal - 1 : 0);
+    shard->cus.clear();
+    shard->cross_deps.clear();
+    if (write)
+        write_checkpoint();
+}
+
+void
+cu_t::write_checkpoint()
+{
+    // Checkpoints are written one at a time, each from a copy taken in turn, so
+    // the last snapshot written is the latest one.
+    const std::lock_guard<std::mutex> writing(snapshot_lock_);
+    cus_t cus;
+    std::unordered_map<int, cursor_t> cursors;
+    std::unordered_map<int, history_t> history;
+    {
+        const std::lock_guard<std::mutex> lg(lock);
+        merge_cus(cus, g_cus);
+        cursors = g_cursors;
+        if (knob_checkpoint_.history)
+            history = g_history;
+    }
+    std::string error = write_snapshot(cus, cursors, history);
+    if (!error.empty())
+        std::cerr << "Checkpoint failed: " << error << "\n";
+}
+
+std::string
+cu_t::write_snapshot(const cus_t& cus, const std::unordered_map<int, cursor_t>& cursors,
+                     const std::unordered_map<int, history_t>& history)
+{
+    snapshot_writer_t out(knob_checkpoint_.path, "cu");
+    out.put(cus.size());
+    for (const auto& cu : cus) {
+        out.put(cu.first);
+        out.put(cu.second.readDataSize);
+        out.put(cu.second.writeDataSize);
+        out.put(cu.second.instructions.size());
+        for (const auto & i : cu.second.instructions)
+            out.put_ptr(i);
+        out.put(cu.second.successors.size());
+        for (const auto & e : cu.second.successors)
+            out.put(e);
+    }
+    out.put(cursors.size());
+    for (const auto& cursor : cursors) {
+        out.put(cursor.first);
+        out.put(cursor.second.position);
+        out.put(cursor.second.cus_count);
+    }
+    out.put(knob_checkpoint_.history ? history.size() : 0);
+    if (!knob_checkpoint_.history)
+        return out.commit();
+    for (const auto& entry : history) {
+        const history_t &shard = entry.second;
+        out.put(entry.first);
+        out.put(shard.reg_history.size());
+        for (const auto& reg : shard.reg_history) {
+            out.put(reg.first);
+            out.put(reg.second);
+        }
+        out.put(shard.mem_history.size());
+        shard.mem_history.for_each([&](app_pc addr, size_t cu) {
+            out.put_ptr(addr);
+            out.put(cu);
+        });
+        out.put(shard.last_is_write.size());
+        shard.last_is_write.for_each([&](app_pc addr, bool is_write) {
+            out.put_ptr(addr);
+            out.put(is_write);
+        });
+    }
+    return out.commit();
+}
+
+std::string
+cu_t::load_snapshot(const std::string &path, bool resume)
+{
+    snapshot_reader_t in;
+    std::string error = in.open(path, "cu");
+    if (!error.empty())
+        return error;
+    // The ids of another run would collide with ours: its cus are numbered
+    // anew in the range no shard uses.
+    std::unordered_map<size_t, size_t> ids;
+    size_t merged_cus = merged_cus_;
+    auto get_id = [&]() {
+        size_t id = in.get();
+        if (resume)
+            return id;
+        auto iter = ids.emplace(id, merged_cus + 1);
+        if (iter.second)
+            merged_cus++;
+        return iter.first->second;
+    };
+    cus_t cus;
+    for (uint64_t count = in.get(); in.ok() && count > 0; count--) {
+        computation_unit_t &cu = cus[get_id()];
+        cu.readDataSize = in.get();
+        cu.writeDataSize = in.get();
+        for (uint64_t n = in.get(); in.ok() && n > 0; n--)
+            cu.instructions.insert(in.get_ptr<byte>());
+        for (uint64_t n = in.get(); in.ok() && n > 0; n--)
+            cu.successors.insert(get_id());
+    }
+    std::unordered_map<int, cursor_t> cursors;
+    for (uint64_t count = in.get(); in.ok() && count > 0; count--) {
+        cursor_t &cursor = cursors[static_cast<int>(in.get())];
+        cursor.position = in.get();
+        cursor.cus_count = in.get();
+    }
+    std::unordered_map<int, history_t> histories;
+    for (uint64_t count = in.get(); in.ok() && count > 0; count--) {
+        history_t &history = histories[static_cast<int>(in.get())];
+        for (uint64_t n = in.get(); in.ok() && n > 0; n--) {
+            reg_t reg = in.get();
+            history.reg_history[reg] = in.get();
+        }
+        for (uint64_t n = in.get(); in.ok() && n > 0; n--) {
+            app_pc addr = in.get_ptr<byte>();
+            history.mem_history[addr] = in.get();
+        }
+        for (uint64_t n = in.get(); in.ok() && n > 0; n--) {
+            app_pc addr = in.get_ptr<byte>();
+            history.last_is_write[addr] = in.get() != 0;
+        }
+    }
+    if (!in.ok())
+        return "Snapshot " + path + " is truncated";
+    merge_cus(g_cus, cus);
+    merged_cus_ = merged_cus;
+    if (resume) {
+        g_cursors = std::move(cursors);
+        g_history = std::move(histories);
+    }
+    return "";
 }
 
 std::string
 cu_t::parallel_shard_error(void *shard_data)
 {
+    shard_data_t * shard = reinterpret_cast<shard_data_t *>(shard_data);
+    if (shard != nullptr && !shard->error.empty())
+        return shard->error;
     // Our parallel operation ignores all but one thread, so we need just
     // the one global error string.
     return error_string_;
@@ -91,82 +377,116 @@ cu_t::parallel_shard_error(void *shard_data)
 bool
 cu_t::process_memref(const memref_t &memref)
 {
-    
-    return parallel_shard_memref(serial_stream_, memref);
+    shard_data_t *shard = serial_shards_.get(
+        memref.data.tid, [&](int index) { return create_shard(index, serial_stream_); });
+    if (!parallel_shard_memref(shard, memref)) {
+        if (!shard->error.empty())
+            error_string_ = shard->error;
+        return false;
+    }
+    return true;
+}
+
+void
+cu_t::record_cross_thread_access(shard_data_t * shard, const memref_t &memref)
+{
+    bool is_write = memref.data.type == TRACE_TYPE_WRITE;
+    if (!is_write && memref.data.type != TRACE_TYPE_READ)
+        return;
+    shard->tid = memref.data.tid;
+    shadow_memory_t::access_result_t res = is_write
+        ? shadow_->on_write(shard->shard_index, shard->timestamp, memref.data.addr,
+                            memref.data.size, memref.data.pc)
+        : shadow_->on_read(shard->shard_index, shard->timestamp, memref.data.addr,
+                           memref.data.size, memref.data.pc);
+    if (!res.raw)
+        return;
+    cross_dep_t dep = { reinterpret_cast<app_pc>(res.writer_pc),
+                        reinterpret_cast<app_pc>(res.reader_pc), res.writer_shard,
+                        res.reader_shard };
+    shard->cross_deps[dep]++;
 }
 
 bool
 cu_t::update_touched_memory_and_regs(shard_data_t * shard, instr_t * instr, size_t cu) {
-    size_t m_index = 0;
-    for (int i = 0; i < instr_num_srcs(instr); i++) {
-        opnd_t opnd = instr_get_src(instr,i);
-        for (int j = 0; j < opnd_num_regs_used(opnd); j++) {
-            reg_id_t reg = opnd_get_reg_used(opnd, j);
-            if (reg_is_gpr(reg) || reg_is_simd(reg) || opnd_is_memory_reference(opnd)) 
-            {
-                shard->mem_history[shard->mem_accs[m_index]] = cu;
-            }else {
-                shard->reg_history[reg] = cu;
-            }
-        }
-    }
+    // Registers written by the instruction; the registers of a memory operand
+    // only form its address.
     for (int i = 0; i < instr_num_dsts(instr); i++) {
         opnd_t opnd = instr_get_dst(instr,i);
-        if (!opnd_is_memory_reference(opnd)) 
+        if (opnd_is_memory_reference(opnd)) 
             continue;
-        for (int j = 0; j < opnd_num_regs_used(opnd); j++) {
-            reg_id_t reg = opnd_get_reg_used(opnd, j);
-            if (reg_is_gpr(reg) || reg_is_simd(reg)) {
-                 shard->last_is_write[shard->mem_accs[m_index]] = cu;
-            }
-        }
+        for (int j = 0; j < opnd_num_regs_used(opnd); j++)
+            shard->reg_history[opnd_get_reg_used(opnd, j)] = cu;
     }
+    for (app_pc addr : shard->mem_accs)
+        shard->mem_history[addr] = cu;
     return true;
 }
 
+void
+cu_t::print_write_accesses(access_ring_t * ring, instr_t * instr, app_pc addr,
+                           bool is_write, bool last_was_write)
+{
+    access_record_t record;
+    record.pc = reinterpret_cast<uint64_t>(instr_get_app_pc(instr));
+    record.addr = reinterpret_cast<uint64_t>(addr);
+    record.flags = 0;
+    if (is_write)
+        record.flags |= access_record_t::IS_WRITE;
+    if (last_was_write)
+        record.flags |= access_record_t::LAST_WAS_WRITE;
+    ring->push(record);
+}
+
+template <bool ACCESS_LOG>
 bool
 cu_t::process_old_reference(shard_data_t * shard, instr_t* instr) {
-    if (instr == nullptr) 
+    if (instr == nullptr) {
+        // Accesses of an untracked instruction.
+        shard->mem_accs.clear();
         return true;
+    }
     
     bool create_new_cu = false;
     size_t m_index = 0;
-    size_t max_cu = 0;
+    size_t max_cu = first_cu(shard->shard_index);
     
+    // Each memory operand consumes the next data record of the instruction, in
+    // operand order; an operand without a record (e.g. not taken) is skipped.
     for (int i = 0; i < instr_num_srcs(instr); i++) {
         opnd_t opnd = instr_get_src(instr,i);
+        if (opnd_is_memory_reference(opnd)) {
+            if (m_index >= shard->mem_accs.size())
+                continue;
+            app_pc addr = shard->mem_accs[m_index++];
+            bool & is_last_write = shard->last_is_write[addr];
+            // Appending trace reference patterns. 
+            if (ACCESS_LOG)
+                print_write_accesses(shard->access_ring, instr, addr, false, is_last_write);
+            create_new_cu = create_new_cu || is_last_write;
+            is_last_write = false;
+            size_t * writer = shard->mem_history.find(addr);
+            if (writer != nullptr)
+                max_cu = std::max(*writer, max_cu);
+            continue;
+        }
         for (int j = 0; j < opnd_num_regs_used(opnd); j++) {
-            reg_id_t reg = opnd_get_reg_used(opnd, j);
-            if (reg_is_gpr(reg) || reg_is_simd(reg) || opnd_is_memory_reference(opnd)) 
-            {
-                bool & is_last_write = shard->last_is_write[shard->mem_accs[m_index]];
-                // Appending trace reference patterns. 
-                print_write_accesses(shard->read_write_access, instr, true, is_last_write);
-                create_new_cu = 
-                    std::max(create_new_cu, is_last_write);
-                is_last_write = false;
-                m_index++;
-                max_cu = shard->mem_history[shard->mem_accs[m_index]];
-            }else if(!create_new_cu) {
-                max_cu = std::max(shard->reg_history[reg], max_cu);
-            }
+            auto iter = shard->reg_history.find(opnd_get_reg_used(opnd, j));
+            if (iter != shard->reg_history.end())
+                max_cu = std::max(iter->second, max_cu);
         }
     }
     // Updating write ref.
     for (int i = 0; i < instr_num_dsts(instr); i++) {
         opnd_t opnd = instr_get_dst(instr,i);
-        if (!opnd_is_memory_reference(opnd)) 
+        if (!opnd_is_memory_reference(opnd) || m_index >= shard->mem_accs.size()) 
             continue;
-        for (int j = 0; j < opnd_num_regs_used(opnd); j++) {
-            reg_id_t reg = opnd_get_reg_used(opnd, j);
-            if (reg_is_gpr(reg) || reg_is_simd(reg)) {
-                bool & is_last_write = shard->last_is_write[shard->mem_accs[m_index]]; 
-                // Appending trace reference patterns. 
-                print_write_accesses(shard->read_write_access, instr, is_last_write, true);
-                is_last_write = true;
-                m_index++;
-            }
-        }
+        app_pc addr = shard->mem_accs[m_index++];
+        bool & is_last_write = shard->last_is_write[addr]; 
+        // Appending trace reference patterns. 
+        if (ACCESS_LOG)
+            print_write_accesses(shard->access_ring, instr, addr, true, is_last_write);
+        is_last_write = true;
     }
     if (create_new_cu) {
         size_t cu_ind = ++shard->cus_count;
@@ -184,50 +504,111 @@ cu_t::process_old_reference(shard_data_t * shard, instr_t* instr) {
     return true;
 }
 
+// The single-pass tool runs the dependence stage too.
+template bool
+cu_t::process_old_reference<false>(shard_data_t * shard, instr_t* instr);
+template bool
+cu_t::process_old_reference<true>(shard_data_t * shard, instr_t* instr);
+
 
 bool
 cu_t::parallel_shard_memref(void *shard_data, const memref_t &memref)
 {
     shard_data_t * shard = reinterpret_cast<shard_data_t *>(shard_data);
-   
-    if(type_is_instr(memref.instr.type) || memref.data.type == TRACE_TYPE_THREAD_EXIT) {
-        process_old_reference(shard,shard->current_instr);
+    if (!shard->error.empty())
+        return false;
+    if (shard->resume_position > 0) {
+        if (record_ordinal(shard) <= shard->resume_position)
+            return true;
+        shard->resume_position = 0;
     }
+    if (checkpoint_trigger_.enabled() &&
+        ++shard->records_since_poll >= checkpoint_trigger_.poll_records() &&
+        type_is_instr(memref.instr.type))
+        checkpoint_shard(shard);
+    return batcher_.add(this, shard, memref);
+}
 
-    if(type_is_data(memref.data.type)) {
-        shard->mem_accs.push_back(reinterpret_cast<app_pc>(memref.data.addr));
-        return true;
-    }
+bool
+cu_t::parallel_shard_memref_batch(void *shard_data, const memref_t *memrefs, size_t count)
+{
+    shard_data_t * shard = reinterpret_cast<shard_data_t *>(shard_data);
+    return batcher_.process(this, shard, memrefs, count);
+}
 
-    if (!type_is_instr(memref.instr.type)) 
-        return true;
-    
-    app_pc decode_pc = const_cast<app_pc>(memref.instr.encoding);
-    const app_pc trace_pc = reinterpret_cast<app_pc>(memref.instr.addr);
-    bool is_transfer_instruction = false;
-    
-    auto instr_iter = shard->instr_cache.find(trace_pc);
-    
-    
-    /// Trying to find this instr in cache. If we haven't met it before, 
-    /// then create it and put into cache.
-    
-    instr_t * instr;
-    if (instr_iter == shard->instr_cache.end()) {
-        instr_init(dcontext_.dcontext, instr);
-        app_pc next_pc =
-            decode_from_copy(dcontext_.dcontext, decode_pc, trace_pc, instr);
-        shard->instr_cache.emplace(trace_pc, instr);
-    } else {
-        instr = instr_iter->second;
-    } 
+template <bool FILTER, bool CROSS_THREAD, bool ACCESS_LOG>
+bool
+cu_t::process_batch(shard_data_t * shard, const memref_t *memrefs, size_t count)
+{
+    memref_pipeline_t<FILTER, dependence_stage_t<ACCESS_LOG>,
+                      optional_stage_t<CROSS_THREAD, cross_thread_stage_t>>
+        pipeline(shard->instr_cache, filter_, shard->filter_cache,
+                 dependence_stage_t<ACCESS_LOG>(this, shard),
+                 optional_stage_t<CROSS_THREAD, cross_thread_stage_t>(this, shard));
+    pipeline.run(memrefs, count);
+    return true;
+}
 
+bool
+cu_t::print_cross_thread_results()
+{
+    static constexpr size_t HOTTEST_LINES = 32;
+    auto tid_of = [&](int shard_index) {
+        auto it = g_shard_tids.find(shard_index);
+        return it == g_shard_tids.end() ? memref_tid_t(-1) : it->second;
+    };
+    std::ofstream out; 
+    out.open("cross_thread.xml");
+    out << "<CrossThread>\n";
+    out << "   <dependences count = \"" << g_cross_deps.size() << "\">\n";
+    for (const auto& dep : g_cross_deps) {
+        out << "      <RAW writer=\"" << std::hex << static_cast<void *>(dep.first.writer_pc)
+            << "\" reader=\"" << static_cast<void *>(dep.first.reader_pc) << std::dec
+            << "\" writerThread=\"" << tid_of(dep.first.writer_shard)
+            << "\" readerThread=\"" << tid_of(dep.first.reader_shard)
+            << "\" count=\"" << dep.second << "\"/>\n";
+    }
+    out << "   </dependences>\n";
+    out << "   <sharing>\n";
+    for (const auto& line : shadow_->hottest_lines(HOTTEST_LINES)) {
+        out << "      <line addr=\"" << std::hex << line.line << std::dec
+            << "\" trueSharing=\"" << line.true_sharing
+            << "\" falseSharing=\"" << line.false_sharing << "\"/>\n";
+    }
+    out << "   </sharing>\n";
+    out << "</CrossThread>\n";
     return true;
 }
 
 bool
 cu_t::print_results()
 {
+    serial_shards_.close_all([&](shard_data_t *shard) { close_shard(shard); });
+    if (access_log_ != nullptr) {
+        // Waits for the writer to compress and close every access pattern file.
+        access_log_->close();
+        if (knob_verbose_ > 0) {
+            std::cerr << "Access log: " << access_log_->stalls()
+                      << " stalls on a full ring\n";
+        }
+    }
+    if (!knob_checkpoint_.path.empty()) {
+        const std::lock_guard<std::mutex> lg(lock);
+        std::string error = write_snapshot(g_cus, g_cursors, g_history);
+        if (!error.empty()) {
+            error_string_ = error;
+            return false;
+        }
+    }
+    if (knob_cross_thread_)
+        print_cross_thread_results();
+
+    if (knob_verbose_ > 0) {
+        arena_t::stats_t stats = arena_stats_;
+        stats += global_arena_.stats();
+        stats.print(std::cerr);
+    }
+
     std::ofstream out; 
     out.open("cus.xml");
     out << "<CUS>\n";
@@ -242,13 +623,13 @@ cu_t::print_results()
         return res;
     };
 
-    for(auto cu : g_cus) {
+    for(const auto& cu : g_cus) {
         
         out << "   <CU id=\"" << cu.first << ">\n";
         out << "      <instructions count = \""<< cu.second.instructions.size() << "\">";
         size_t ind = 0;
         for (auto i : cu.second.instructions) {
-            out << std::hex << "\"" << i << "\""; 
+            out << std::hex << "\"" << static_cast<void *>(i) << "\""; 
             if (ind != cu.second.instructions.size() + 1){
                 out << ",";
             }
@@ -7,11 +7,20 @@
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <memory>
 #include <mutex>
+#include <vector>
 
+#include "access_log.h"
+#include "addr_map.h"
 #include "analysis_tool.h"
+#include "arena.h"
 #include "raw2trace.h"
 #include "raw2trace_directory.h"
+#include "module_filter.h"
+#include "pipeline.h"
+#include "shadow_memory.h"
+#include "snapshot.h"
 
 class cu_t : public analysis_tool_t {
 public:
@@ -21,7 +30,11 @@ public:
     // std::optional here.
     cu_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t sim_refs,
            const std::string &syntax, unsigned int verbose,
-           const std::string &alt_module_dir = "");
+           const std::string &alt_module_dir = "", bool cross_thread = false,
+           const std::string &filter = "", unsigned int batch_size = 0,
+           const std::string &access_log_dir = "",
+           const checkpoint_options_t &checkpoint = checkpoint_options_t(),
+           bool huge_pages = false);
     std::string
     initialize_stream(memtrace_stream_t *serial_stream) override;
     bool
@@ -33,6 +46,10 @@ public:
     parallel_shard_exit(void *shard_data) override;
     bool
     parallel_shard_memref(void *shard_data, const memref_t &memref) override;
+    /// Processes a span of records of one shard: each window of the span is
+    /// scanned first to prefetch the cache and shadow entries it will touch.
+    bool
+    parallel_shard_memref_batch(void *shard_data, const memref_t *memrefs, size_t count);
     std::string
     parallel_shard_error(void *shard_data) override;
     bool
@@ -100,6 +117,19 @@ protected:
     int64_t filetype_record_ord_ = -1;
     bool has_modules_;
     memtrace_stream_t *serial_stream_ = nullptr;
+    /// Detect dependences between threads through the shared shadow memory.
+    bool knob_cross_thread_;
+    std::unique_ptr<shadow_memory_t> shadow_;
+    /// Spec of the code to track; see module_filter_t.
+    std::string knob_filter_;
+    module_filter_t filter_;
+    /// Where the read/write access pattern stream is written; none if empty.
+    std::string knob_access_log_dir_;
+    std::unique_ptr<access_log_t> access_log_;
+    checkpoint_options_t knob_checkpoint_;
+    checkpoint_trigger_t checkpoint_trigger_;
+    /// Back the arenas with huge pages.
+    bool knob_huge_pages_;
     
    
     struct mem_acc_t
@@ -112,18 +142,39 @@ protected:
     {
         size_t cu_id;
         /// instruction which inside this cu. 
-        std::unordered_set<app_pc> instructions;
+        std::unordered_set<app_pc, std::hash<app_pc>, std::equal_to<app_pc>,
+                           arena_allocator_t<app_pc>> instructions;
         /// successors cus.
-        std::unordered_set<size_t> successors;
-        size_t readDataSize;
-        size_t writeDataSize;
-        
+        std::unordered_set<size_t, std::hash<size_t>, std::equal_to<size_t>,
+                           arena_allocator_t<size_t>> successors;
+        size_t readDataSize = 0;
+        size_t writeDataSize = 0;
         
-        computation_unit_t(instr_t * instr)
+        /// The sets live in the arena of the map holding the cu.
+        using allocator_type = arena_allocator_t<char>;
+        computation_unit_t(instr_t * instr, const allocator_type &alloc = allocator_type())
+            : instructions(alloc), successors(alloc)
         {
             add(instr);
         }
-        computation_unit_t() = default;
+        explicit computation_unit_t(const allocator_type &alloc = allocator_type())
+            : instructions(alloc), successors(alloc)
+        {
+        }
+        computation_unit_t(const computation_unit_t &other, const allocator_type &alloc)
+            : cu_id(other.cu_id), instructions(other.instructions, alloc)
+            , successors(other.successors, alloc), readDataSize(other.readDataSize)
+            , writeDataSize(other.writeDataSize)
+        {
+        }
+        computation_unit_t(computation_unit_t &&other, const allocator_type &alloc)
+            : cu_id(other.cu_id), instructions(std::move(other.instructions), alloc)
+            , successors(std::move(other.successors), alloc)
+            , readDataSize(other.readDataSize), writeDataSize(other.writeDataSize)
+        {
+        }
+        computation_unit_t(const computation_unit_t &) = default;
+        computation_unit_t(computation_unit_t &&) = default;
         
         inline void add_edge(size_t cu){
             successors.insert(cu);
@@ -135,31 +186,223 @@ protected:
         
     };
 
+    /// RAW dependence where a value written by one thread is read by another. The
+    /// threads are given by shard index; see g_shard_tids.
+    struct cross_dep_t
+    {
+        app_pc writer_pc;
+        app_pc reader_pc;
+        int writer_shard;
+        int reader_shard;
+        bool operator==(const cross_dep_t &other) const
+        {
+            return writer_pc == other.writer_pc && reader_pc == other.reader_pc &&
+                writer_shard == other.writer_shard && reader_shard == other.reader_shard;
+        }
+    };
+    struct cross_dep_hash_t
+    {
+        size_t operator()(const cross_dep_t &dep) const
+        {
+            return std::hash<app_pc>()(dep.writer_pc) ^
+                (std::hash<app_pc>()(dep.reader_pc) << 1) ^
+                (static_cast<size_t>(dep.writer_shard) << 17) ^
+                (static_cast<size_t>(dep.reader_shard) << 33);
+        }
+    };
+    using cross_deps_t = std::unordered_map<cross_dep_t, uint64_t, cross_dep_hash_t>;
+
+    using cus_t =
+        std::unordered_map<size_t, computation_unit_t, std::hash<size_t>,
+                           std::equal_to<size_t>,
+                           arena_scoped_allocator_t<std::pair<const size_t, computation_unit_t>>>;
+
+    /// Where the published state of a shard stands: its records up to the
+    /// record ordinal position are in g_cus, and cus_count is its last cu id.
+    struct cursor_t {
+        uint64_t position = 0;
+        size_t cus_count = 0;
+    };
+    /// Dependence state of a shard, kept in snapshots so that a resumed run
+    /// continues where the previous segment stopped.
+    struct history_t {
+        std::unordered_map<reg_t, size_t> reg_history;
+        addr_map_t<size_t> mem_history;
+        addr_map_t<bool> last_is_write;
+    };
+
+    /// The cu maps are made in their arena and never destroyed: tearing down the
+    /// arena frees them at once instead of node by node.
+    arena_t global_arena_;
     std::mutex lock;
-    std::unordered_map<size_t, computation_unit_t> g_cus;
+    cus_t &g_cus;
+    /// Allocator statistics of the exited shards.
+    arena_t::stats_t arena_stats_;
+    cross_deps_t g_cross_deps;
+    /// Thread of each published shard that fed the shadow memory, by shard index.
+    std::unordered_map<int, memref_tid_t> g_shard_tids;
+    /// Cursors and histories of the published shards and of the resumed
+    /// snapshot, by shard index.
+    std::unordered_map<int, cursor_t> g_cursors;
+    std::unordered_map<int, history_t> g_history;
+    /// Last id given to a cu of a merged snapshot; see load_snapshot().
+    size_t merged_cus_ = 0;
+    /// Held while a checkpoint is written; taken before the lock.
+    std::mutex snapshot_lock_;
     
     struct shard_data_t {
-        size_t cus_count;
-        std::unordered_map<size_t, computation_unit_t> cus;
+        shard_data_t(bool huge_pages, void *dcontext)
+            : arena(huge_pages)
+            , cus(*arena.make<cus_t>(arena_allocator_t<char>(&arena)))
+            , instr_cache(dcontext, arena)
+        {
+        }
+        /// Holds the cus and the decoded instructions.
+        arena_t arena;
+        cus_t &cus;
+        instr_cache_t instr_cache;
+        int shard_index = -1;
+        /// Provides the record ordinals that place the shard in the trace.
+        memtrace_stream_t *stream = nullptr;
+        /// Records up to this ordinal were covered by the resumed snapshot.
+        uint64_t resume_position = 0;
+        /// Set when the shard could not be set up; its records are refused.
+        std::string error;
+        /// Last TRACE_MARKER_TYPE_TIMESTAMP seen in this shard.
+        uint64_t timestamp = 0;
+        /// Thread of the records fed to the shadow memory; -1 before the first.
+        memref_tid_t tid = -1;
+        cross_deps_t cross_deps;
+        module_filter_t::cache_t filter_cache;
+        /// Last cu id handed out; starts at the shard's root cu, see first_cu().
+        size_t cus_count = 0;
         std::vector<app_pc> mem_accs;
         std::unordered_map<reg_t, size_t> reg_history;
-        std::unordered_map<app_pc, size_t> mem_history;
-        std::unordered_map<app_pc, bool> last_is_write;
-        std::unordered_map<app_pc, instr_t *> instr_cache;
-        instr_t * current_instr;
-        bool is_new_bb;
+        addr_map_t<size_t> mem_history;
+        addr_map_t<bool> last_is_write;
+        std::vector<memref_t> batch;
+        /// Records since the shard last polled checkpoint_trigger_, and the
+        /// epoch of its last publication.
+        uint64_t records_since_poll = 0;
+        uint64_t checkpoint_epoch = 0;
+        instr_t * current_instr = nullptr;
+        bool is_new_bb = false;
         app_pc last_bb_head = nullptr;
         app_pc last_bb_tail = nullptr;
-        std::ostream read_write_access;
+        /// Access pattern stream of this shard; null when it is not logged.
+        access_ring_t * access_ring = nullptr;
     };
+    serial_shards_t<shard_data_t> serial_shards_;
 private:
+    /// Runs the cu stages next to the block stage in a single pass.
+    friend class cfg_cu_t;
+
     static constexpr int RECORD_COLUMN_WIDTH = 12;
     static constexpr int INSTR_COLUMN_WIDTH = 12;
     static constexpr int TID_COLUMN_WIDTH = 11;
+
+    /// Pipeline stage building the cus from register and memory dependences; an
+    /// instruction is complete, and is processed, once the next one arrives.
+    template <bool ACCESS_LOG>
+    struct dependence_stage_t : public pipeline_stage_t {
+        dependence_stage_t(cu_t * tool, shard_data_t * shard) : tool(tool), shard(shard) { }
+        void
+        prefetch(const memref_t &memref)
+        {
+            if (type_is_data(memref.data.type)) {
+                app_pc addr = reinterpret_cast<app_pc>(memref.data.addr);
+                shard->mem_history.prefetch(addr);
+                shard->last_is_write.prefetch(addr);
+            }
+        }
+        void
+        on_excluded(const memref_t &memref)
+        {
+            // The pending instruction has all its data refs by now.
+            tool->process_old_reference<ACCESS_LOG>(shard, shard->current_instr);
+            shard->current_instr = nullptr;
+        }
+        void
+        on_instr(const memref_t &memref, instr_t * instr, bool first_seen)
+        {
+            tool->process_old_reference<ACCESS_LOG>(shard, shard->current_instr);
+            shard->current_instr = instr;
+        }
+        void
+        on_data(const memref_t &memref)
+        {
+            shard->mem_accs.push_back(reinterpret_cast<app_pc>(memref.data.addr));
+        }
+        void
+        on_thread_exit(const memref_t &memref)
+        {
+            tool->process_old_reference<ACCESS_LOG>(shard, shard->current_instr);
+            shard->current_instr = nullptr;
+        }
+        cu_t * tool;
+        shard_data_t * shard;
+    };
+    /// Pipeline stage feeding the shared shadow memory.
+    struct cross_thread_stage_t : public pipeline_stage_t {
+        cross_thread_stage_t(cu_t * tool, shard_data_t * shard) : tool(tool), shard(shard) { }
+        void
+        prefetch(const memref_t &memref)
+        {
+            if (type_is_data(memref.data.type))
+                tool->shadow_->prefetch(memref.data.addr);
+        }
+        void
+        on_marker(const memref_t &memref)
+        {
+            if (memref.marker.marker_type == TRACE_MARKER_TYPE_TIMESTAMP)
+                shard->timestamp = memref.marker.marker_value;
+        }
+        void
+        on_data(const memref_t &memref)
+        {
+            tool->record_cross_thread_access(shard, memref);
+        }
+        cu_t * tool;
+        shard_data_t * shard;
+    };
+    friend class memref_batcher_t<cu_t, shard_data_t>;
+    memref_batcher_t<cu_t, shard_data_t> batcher_;
+
+    template <bool FILTER, bool CROSS_THREAD, bool ACCESS_LOG>
+    bool
+    process_batch(shard_data_t * shard, const memref_t *memrefs, size_t count);
     bool
     update_touched_memory_and_regs(shard_data_t * shard, instr_t * instr, size_t cu);
-    void print_write_accesses(std::ostream& ostr, instr_t * instr, bool read, bool write );
+    void print_write_accesses(access_ring_t * ring, instr_t * instr, app_pc addr,
+                              bool is_write, bool last_was_write);
+    /// Cu ids carry the shard index above CU_SHARD_SHIFT, so that the cus of
+    /// different threads stay apart when merged; the first id of a shard is its
+    /// root cu, which instructions without a dependence join.
+    static constexpr unsigned int CU_SHARD_SHIFT = 40;
+    static size_t
+    first_cu(int shard_index)
+    {
+        return static_cast<size_t>(shard_index + 1) << CU_SHARD_SHIFT;
+    }
+    shard_data_t * create_shard(int shard_index, memtrace_stream_t *stream);
+    void close_shard(shard_data_t * shard);
+    static void merge_cus(cus_t& into, const cus_t& from);
+    static uint64_t record_ordinal(const shard_data_t * shard);
+    /// Publishes the shard once per checkpoint epoch, at an instruction record,
+    /// and writes the snapshot if the shard starts the epoch.
+    void checkpoint_shard(shard_data_t * shard);
+    void write_checkpoint();
+    std::string write_snapshot(const cus_t& cus, const std::unordered_map<int, cursor_t>& cursors,
+                               const std::unordered_map<int, history_t>& history);
+    /// A resumed snapshot restores the cursors and histories; the cus of a
+    /// merged one get fresh ids below first_cu(0).
+    std::string load_snapshot(const std::string &path, bool resume);
+    template <bool ACCESS_LOG>
     bool process_old_reference(shard_data_t * shard, instr_t* instr);
+    void record_cross_thread_access(shard_data_t * shard, const memref_t &memref);
+    /// Publishes the shard's records up to the record ordinal position.
+    void merge_shard(shard_data_t * shard, uint64_t position);
+    bool print_cross_thread_results();
     
 
 };
@@ -0,0 +1,159 @@
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include "dr_api.h"
+#include "drsyms.h"
+#include "module_filter.h"
+
+module_filter_t::module_filter_t()
+    : table_ { { 0, false } }
+{
+}
+
+std::string
+module_filter_t::parse(const std::string &spec)
+{
+    std::stringstream ss(spec);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        if (token.empty())
+            continue;
+        if (token[0] != '+' && token[0] != '-')
+            return "Filter item \"" + token + "\" must start with '+' or '-'";
+        item_t item;
+        item.include = token[0] == '+';
+        std::string body = token.substr(1);
+        size_t bang = body.find('!');
+        size_t dash = body.find('-');
+        if (bang != std::string::npos) {
+            item.kind = ITEM_SYMBOL;
+            item.module = body.substr(0, bang);
+            item.symbol = body.substr(bang + 1);
+            needs_modules_ = true;
+        } else if (body.compare(0, 2, "0x") == 0 && dash != std::string::npos) {
+            item.kind = ITEM_RANGE;
+            char *end;
+            item.start = std::strtoull(body.c_str(), &end, 16);
+            if (end != body.c_str() + dash)
+                return "Invalid filter range \"" + body + "\"";
+            item.end = std::strtoull(body.c_str() + dash + 1, &end, 16);
+            if (*end != '\0' || item.end <= item.start)
+                return "Invalid filter range \"" + body + "\"";
+        } else {
+            item.kind = ITEM_MODULE;
+            item.module = body;
+            needs_modules_ = true;
+        }
+        items_.push_back(item);
+    }
+    return "";
+}
+
+std::string
+module_filter_t::compile(module_mapper_t *module_mapper)
+{
+    struct event_t {
+        uintptr_t addr;
+        int include_delta;
+        int exclude_delta;
+    };
+    std::vector<event_t> events;
+    bool have_includes = false;
+    auto add_range = [&](bool include, uintptr_t start, uintptr_t end) {
+        if (include) {
+            events.push_back({ start, 1, 0 });
+            events.push_back({ end, -1, 0 });
+        } else {
+            events.push_back({ start, 0, 1 });
+            events.push_back({ end, 0, -1 });
+        }
+    };
+
+    if (needs_modules_ && module_mapper == nullptr)
+        return "Module filters need the module file";
+    if (needs_modules_)
+        drsym_init(0);
+    std::string error;
+    for (const item_t &item : items_) {
+        have_includes = have_includes || item.include;
+        if (item.kind == ITEM_RANGE) {
+            add_range(item.include, item.start, item.end);
+            continue;
+        }
+        bool found = false;
+        for (const module_t &mod : module_mapper->get_loaded_modules()) {
+            if (mod.path == nullptr ||
+                std::string(mod.path).find(item.module) == std::string::npos)
+                continue;
+            uintptr_t base = reinterpret_cast<uintptr_t>(mod.orig_seg_base);
+            if (item.kind == ITEM_MODULE) {
+                // Every segment has an entry of its own; the gaps between them
+                // may hold other mappings.
+                add_range(item.include, base, base + mod.seg_size);
+                found = true;
+                continue;
+            }
+            if (mod.seg_offs != 0)
+                continue;
+            size_t offs;
+            if (drsym_lookup_symbol(mod.path, item.symbol.c_str(), &offs,
+                                    DRSYM_DEFAULT_FLAGS) != DRSYM_SUCCESS)
+                continue;
+            drsym_info_t info = {};
+            info.struct_size = sizeof(info);
+            if (drsym_lookup_address(mod.path, offs, &info, DRSYM_DEFAULT_FLAGS) !=
+                DRSYM_SUCCESS)
+                continue;
+            add_range(item.include, base + info.start_offs, base + info.end_offs);
+            found = true;
+        }
+        if (!found && item.include) {
+            error = "Filter item \"" + item.module + "\" matches no loaded code";
+            break;
+        }
+    }
+    if (needs_modules_)
+        drsym_exit();
+    if (!error.empty())
+        return error;
+
+    // Sweep over the sorted range ends, giving each elementary interval its verdict,
+    // and merge neighbours with the same verdict.
+    std::sort(events.begin(), events.end(),
+              [](const event_t &a, const event_t &b) { return a.addr < b.addr; });
+    table_.clear();
+    table_.push_back({ 0, have_includes });
+    int include_depth = 0, exclude_depth = 0;
+    for (size_t i = 0; i < events.size();) {
+        uintptr_t addr = events[i].addr;
+        for (; i < events.size() && events[i].addr == addr; i++) {
+            include_depth += events[i].include_delta;
+            exclude_depth += events[i].exclude_delta;
+        }
+        bool excluded = exclude_depth > 0 || (have_includes && include_depth == 0);
+        if (table_.back().excluded == excluded)
+            continue;
+        if (table_.back().start != addr)
+            table_.push_back({ addr, excluded });
+        else if (table_.size() > 1 && table_[table_.size() - 2].excluded == excluded)
+            table_.pop_back();
+        else
+            table_.back().excluded = excluded;
+    }
+    return "";
+}
+
+bool
+module_filter_t::refill(cache_t &cache, uintptr_t pc) const
+{
+    auto next = std::upper_bound(
+        table_.begin(), table_.end(), pc,
+        [](uintptr_t value, const interval_t &interval) { return value < interval.start; });
+    const interval_t &cur = *(next - 1);
+    uintptr_t end = next == table_.end() ? UINTPTR_MAX : next->start;
+    cache.start = cur.start;
+    cache.size = end - cur.start;
+    cache.excluded = cur.excluded;
+    return cur.excluded;
+}
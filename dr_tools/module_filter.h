@@ -0,0 +1,86 @@
+#ifndef _MODULE_FILTER_H_
+#define _MODULE_FILTER_H_ 1
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "raw2trace.h"
+
+/// Include/exclude filter on the pc of traced code.
+/// The spec is a comma-separated list of items, each prefixed with '+' (include)
+/// or '-' (exclude):
+///   +app, -libc.so       modules whose path contains the given name;
+///   -0x7f00-0x7fff       an explicit [start, end) address range;
+///   -libfoo.so!bar       a symbol, resolved with drsyms.
+/// With no include items everything not excluded is tracked. The items are
+/// compiled into a sorted table partitioning the address space, and each shard
+/// caches the interval of its last lookup, so a check is one predictable branch.
+class module_filter_t {
+public:
+    /// Per-shard cache of the interval the last lookup landed in.
+    struct cache_t {
+        uintptr_t start = 0;
+        uintptr_t size = 0;
+        bool excluded = false;
+    };
+
+    module_filter_t();
+
+    /// Parses the spec; returns an error string or "" on success.
+    std::string
+    parse(const std::string &spec);
+
+    /// Whether some items need the module list to be resolved.
+    bool
+    needs_modules() const
+    {
+        return needs_modules_;
+    }
+
+    /// Resolves module and symbol items against the loaded modules (may be null
+    /// when there are none) and builds the range table.
+    std::string
+    compile(module_mapper_t *module_mapper);
+
+    /// Whether the compiled table excludes nothing, so that the checks can be
+    /// left out altogether.
+    bool
+    empty() const
+    {
+        return table_.size() == 1 && !table_[0].excluded;
+    }
+
+    inline bool
+    excluded(cache_t &cache, uintptr_t pc) const
+    {
+        if (pc - cache.start < cache.size)
+            return cache.excluded;
+        return refill(cache, pc);
+    }
+
+private:
+    enum item_kind_t { ITEM_MODULE, ITEM_RANGE, ITEM_SYMBOL };
+    struct item_t {
+        item_kind_t kind;
+        bool include;
+        std::string module;
+        std::string symbol;
+        uintptr_t start = 0;
+        uintptr_t end = 0;
+    };
+    struct interval_t {
+        uintptr_t start;
+        bool excluded;
+    };
+
+    bool
+    refill(cache_t &cache, uintptr_t pc) const;
+
+    std::vector<item_t> items_;
+    bool needs_modules_ = false;
+    /// Sorted by start; the first interval starts at 0.
+    std::vector<interval_t> table_;
+};
+
+#endif /* _MODULE_FILTER_H_ */
@@ -0,0 +1,51 @@
+
+#include "dr_api.h"
+#include "pipeline.h"
+
+std::string
+init_module_filter(module_filter_t &filter, const std::string &spec,
+                   const std::string &module_file_path, unsigned int verbose,
+                   const std::string &alt_module_dir, raw2trace_directory_t &directory,
+                   std::unique_ptr<module_mapper_t> &module_mapper)
+{
+    std::string error = filter.parse(spec);
+    if (!error.empty())
+        return error;
+    if (filter.needs_modules() && !module_file_path.empty()) {
+        error = directory.initialize_module_file(module_file_path);
+        if (!error.empty())
+            return "Failed to initialize directory: " + error;
+        module_mapper = module_mapper_t::create(directory.modfile_bytes_, nullptr,
+                                                nullptr, nullptr, nullptr, verbose,
+                                                alt_module_dir);
+        module_mapper->get_loaded_modules();
+        error = module_mapper->get_last_error();
+        if (!error.empty())
+            return "Failed to load binaries: " + error;
+    }
+    return filter.compile(module_mapper.get());
+}
+
+instr_cache_t::~instr_cache_t()
+{
+    if (shared_ != nullptr)
+        return;
+    instrs_.for_each([&](app_pc pc, instr_t *instr) { instr_free(dcontext_, instr); });
+}
+
+instr_t *
+instr_cache_t::decode_new(const memref_t &memref)
+{
+    app_pc decode_pc = const_cast<app_pc>(memref.instr.encoding);
+    app_pc trace_pc = reinterpret_cast<app_pc>(memref.instr.addr);
+    instr_t *instr;
+    if (shared_ != nullptr) {
+        instr = shared_->decode(memref);
+    } else {
+        instr = arena_.make<instr_t>();
+        instr_init(dcontext_, instr);
+        decode_from_copy(dcontext_, decode_pc, trace_pc, instr);
+    }
+    instrs_[trace_pc] = instr;
+    return instr;
+}
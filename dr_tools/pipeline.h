@@ -0,0 +1,353 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_ 1
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "addr_map.h"
+#include "analysis_tool.h"
+#include "arena.h"
+#include "module_filter.h"
+#include "raw2trace.h"
+#include "raw2trace_directory.h"
+
+/// Base of the pipeline stages: every hook does nothing, and a stage overrides
+/// (hides) only the hooks it needs. A disabled feature is this stage itself, so
+/// its calls compile away.
+struct pipeline_stage_t {
+    pipeline_stage_t() = default;
+    /// Lets the empty stage be built from the arguments of the one it replaces.
+    template <typename... Args> explicit pipeline_stage_t(Args &&...)
+    {
+    }
+
+    /// Issues the cache misses the record will take in this stage.
+    void
+    prefetch(const memref_t &memref)
+    {
+    }
+    void
+    on_marker(const memref_t &memref)
+    {
+    }
+    /// An instruction the filter excludes.
+    void
+    on_excluded(const memref_t &memref)
+    {
+    }
+    /// A tracked instruction; first_seen is set the first time its pc is decoded.
+    void
+    on_instr(const memref_t &memref, instr_t *instr, bool first_seen)
+    {
+    }
+    /// A data access of a tracked instruction.
+    void
+    on_data(const memref_t &memref)
+    {
+    }
+    void
+    on_thread_exit(const memref_t &memref)
+    {
+    }
+};
+
+/// Stage that is present only when the feature is enabled.
+template <bool ENABLED, typename Stage>
+using optional_stage_t = typename std::conditional<ENABLED, Stage, pipeline_stage_t>::type;
+
+class shared_instr_cache_t;
+
+/// Decoded instructions of one shard by trace pc, shared by all the stages of a
+/// pipeline: each pc is decoded once, into the shard's arena.
+class instr_cache_t {
+public:
+    instr_cache_t(void *dcontext, arena_t &arena)
+        : dcontext_(dcontext)
+        , arena_(arena)
+    {
+    }
+    /// A cache in front of a shared one: a pc missing here is taken from the
+    /// shared cache, which decodes it if no other user has, and only referenced.
+    instr_cache_t(shared_instr_cache_t &shared, arena_t &arena)
+        : dcontext_(nullptr)
+        , arena_(arena)
+        , shared_(&shared)
+    {
+    }
+    /// Releases what DR allocated for the operands of the instructions it
+    /// decoded; the instructions themselves go with the arena.
+    ~instr_cache_t();
+    instr_cache_t(const instr_cache_t &) = delete;
+    instr_cache_t &
+    operator=(const instr_cache_t &) = delete;
+
+    inline instr_t *
+    decode(const memref_t &memref, bool &first_seen)
+    {
+        app_pc trace_pc = reinterpret_cast<app_pc>(memref.instr.addr);
+        instr_t **cached = instrs_.find(trace_pc);
+        first_seen = cached == nullptr;
+        if (first_seen)
+            return decode_new(memref);
+        return *cached;
+    }
+
+    inline void
+    prefetch(const memref_t &memref) const
+    {
+        instrs_.prefetch(reinterpret_cast<app_pc>(memref.instr.addr));
+    }
+
+private:
+    instr_t *
+    decode_new(const memref_t &memref);
+
+    void *dcontext_;
+    arena_t &arena_;
+    shared_instr_cache_t *shared_ = nullptr;
+    addr_map_t<instr_t *> instrs_;
+};
+
+/// Decoded instructions shared by the threads working on one trace shard, such
+/// as the workers of its chunks. Each user keeps an instr_cache_t in front of it,
+/// so the lock is taken only the first time a user meets a pc.
+class shared_instr_cache_t {
+public:
+    shared_instr_cache_t(void *dcontext, bool huge_pages)
+        : arena_(huge_pages)
+        , instrs_(dcontext, arena_)
+    {
+    }
+
+    instr_t *
+    decode(const memref_t &memref)
+    {
+        const std::lock_guard<std::mutex> lg(mutex_);
+        bool first_seen;
+        return instrs_.decode(memref, first_seen);
+    }
+
+    const arena_t::stats_t &
+    stats() const
+    {
+        return arena_.stats();
+    }
+
+private:
+    std::mutex mutex_;
+    arena_t arena_;
+    instr_cache_t instrs_;
+};
+
+/// Per-record driver shared by the tools. It classifies each record once,
+/// applies the module filter, decodes instructions through the shard's cache and
+/// hands the result to each stage in order. Which features run is fixed by the
+/// template arguments, so an instantiation carries no checks for the others, and
+/// a single pipeline can feed the stages of several tools from one pass.
+template <bool FILTER, typename... Stages> class memref_pipeline_t {
+public:
+    /// Records of a batch scanned ahead to prefetch what they will touch.
+    static constexpr size_t PREFETCH_WINDOW = 32;
+
+    memref_pipeline_t(instr_cache_t &instrs, const module_filter_t &filter,
+                      module_filter_t::cache_t &filter_cache, Stages... stages)
+        : instrs_(instrs)
+        , filter_(filter)
+        , filter_cache_(filter_cache)
+        , stages_(stages...)
+    {
+    }
+
+    void
+    run(const memref_t *memrefs, size_t count)
+    {
+        // Issue the misses of a whole window before the stages stall on the
+        // first of them.
+        for (size_t start = 0; start < count; start += PREFETCH_WINDOW) {
+            size_t end = std::min(count, start + PREFETCH_WINDOW);
+            for (size_t i = start; i < end; i++)
+                prefetch(memrefs[i]);
+            for (size_t i = start; i < end; i++)
+                process(memrefs[i]);
+        }
+    }
+
+    inline void
+    prefetch(const memref_t &memref)
+    {
+        if (type_is_instr(memref.instr.type))
+            instrs_.prefetch(memref);
+        for_each_stage([&](auto &stage) { stage.prefetch(memref); });
+    }
+
+    inline void
+    process(const memref_t &memref)
+    {
+        if (type_is_instr(memref.instr.type)) {
+            if (FILTER && filter_.excluded(filter_cache_, memref.instr.addr)) {
+                for_each_stage([&](auto &stage) { stage.on_excluded(memref); });
+                return;
+            }
+            bool first_seen;
+            instr_t *instr = instrs_.decode(memref, first_seen);
+            for_each_stage([&](auto &stage) { stage.on_instr(memref, instr, first_seen); });
+        } else if (type_is_data(memref.data.type)) {
+            if (FILTER && filter_.excluded(filter_cache_, memref.data.pc))
+                return;
+            for_each_stage([&](auto &stage) { stage.on_data(memref); });
+        } else if (memref.marker.type == TRACE_TYPE_MARKER) {
+            for_each_stage([&](auto &stage) { stage.on_marker(memref); });
+        } else if (memref.data.type == TRACE_TYPE_THREAD_EXIT) {
+            for_each_stage([&](auto &stage) { stage.on_thread_exit(memref); });
+        }
+    }
+
+private:
+    template <typename F>
+    inline void
+    for_each_stage(F func)
+    {
+        for_each_stage(func, std::index_sequence_for<Stages...>());
+    }
+    template <typename F, size_t... I>
+    inline void
+    for_each_stage(F &func, std::index_sequence<I...>)
+    {
+        int expand[] = { 0, (func(std::get<I>(stages_)), 0)... };
+        (void)expand;
+    }
+
+    instr_cache_t &instrs_;
+    const module_filter_t &filter_;
+    module_filter_t::cache_t &filter_cache_;
+    std::tuple<Stages...> stages_;
+};
+
+/// Maps runtime feature flags to the instantiation built for them, once, so
+/// that the records go straight to specialized code. Target provides fn_t and
+/// a static get<FLAGS...>() returning the instantiation for the flags.
+template <typename Target, bool... FLAGS> struct pipeline_select_t {
+    static typename Target::fn_t
+    get()
+    {
+        return Target::template get<FLAGS...>();
+    }
+    template <typename... Rest>
+    static typename Target::fn_t
+    get(bool flag, Rest... rest)
+    {
+        return flag ? pipeline_select_t<Target, FLAGS..., true>::get(rest...)
+                    : pipeline_select_t<Target, FLAGS..., false>::get(rest...);
+    }
+};
+
+/// Parses the filter spec and compiles it, loading the modules of the trace
+/// first when the spec names any. Returns an error string or "" on success.
+std::string
+init_module_filter(module_filter_t &filter, const std::string &spec,
+                   const std::string &module_file_path, unsigned int verbose,
+                   const std::string &alt_module_dir, raw2trace_directory_t &directory,
+                   std::unique_ptr<module_mapper_t> &module_mapper);
+
+/// Feeds the records of a tool's shards to the process_batch instantiation for
+/// the enabled features, buffering them per shard first. Tool has a template
+/// member process_batch<FLAGS...>(Shard *, const memref_t *, size_t), and Shard
+/// a std::vector<memref_t> batch.
+template <typename Tool, typename Shard> class memref_batcher_t {
+public:
+    using fn_t = bool (Tool::*)(Shard *, const memref_t *, size_t);
+
+    /// batch_size records are buffered per shard before a batch is processed;
+    /// 0 processes each record as it arrives.
+    explicit memref_batcher_t(unsigned int batch_size)
+        : batch_size_(batch_size)
+    {
+    }
+
+    /// Picks the instantiation; the flags go in the order of the template
+    /// parameters of process_batch.
+    template <typename... Flags>
+    void
+    select(Flags... flags)
+    {
+        process_ = pipeline_select_t<memref_batcher_t>::get(flags...);
+    }
+
+    template <bool... FLAGS>
+    static fn_t
+    get()
+    {
+        return &Tool::template process_batch<FLAGS...>;
+    }
+
+    inline bool
+    process(Tool *tool, Shard *shard, const memref_t *memrefs, size_t count)
+    {
+        return (tool->*process_)(shard, memrefs, count);
+    }
+
+    inline bool
+    add(Tool *tool, Shard *shard, const memref_t &memref)
+    {
+        if (batch_size_ == 0)
+            return process(tool, shard, &memref, 1);
+        shard->batch.push_back(memref);
+        if (shard->batch.size() < batch_size_)
+            return true;
+        return flush(tool, shard);
+    }
+
+    /// Processes what the shard has buffered.
+    bool
+    flush(Tool *tool, Shard *shard)
+    {
+        if (shard->batch.empty())
+            return true;
+        bool res = process(tool, shard, shard->batch.data(), shard->batch.size());
+        shard->batch.clear();
+        return res;
+    }
+
+private:
+    unsigned int batch_size_;
+    fn_t process_ = nullptr;
+};
+
+/// Shards of the serial mode, one per thread, made on the first record of the
+/// thread.
+template <typename Shard> class serial_shards_t {
+public:
+    /// create(shard_index) makes the shard of a new thread.
+    template <typename Create>
+    Shard *
+    get(memref_tid_t tid, Create create)
+    {
+        std::unique_ptr<Shard> &shard = shards_[tid];
+        if (!shard)
+            shard.reset(create(static_cast<int>(shards_.size()) - 1));
+        return shard.get();
+    }
+
+    /// Hands every shard to close and drops them all.
+    template <typename Close>
+    void
+    close_all(Close close)
+    {
+        for (auto &shard : shards_)
+            close(shard.second.get());
+        shards_.clear();
+    }
+
+private:
+    std::unordered_map<memref_tid_t, std::unique_ptr<Shard>> shards_;
+};
+
+#endif /* _PIPELINE_H_ */
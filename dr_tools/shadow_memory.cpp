@@ -0,0 +1,144 @@
+
+#include <algorithm>
+#include "shadow_memory.h"
+
+namespace {
+
+/// Layout of line_slot_t::last: (shard + 1) | offset | size | is_write.
+inline uint64_t
+pack_line_access(int shard, size_t offset, size_t size, bool is_write)
+{
+    return (static_cast<uint64_t>(shard + 1) << 32) | (static_cast<uint64_t>(offset) << 16) |
+        (static_cast<uint64_t>(std::min<size_t>(size, 0x7fff)) << 1) | (is_write ? 1 : 0);
+}
+
+} // namespace
+
+void
+shadow_memory_t::publish(std::atomic<uint64_t> &time, std::atomic<uint64_t> &origin,
+                         uint64_t new_time, uint64_t new_origin)
+{
+    // Only move forward in trace time: a shard running behind must not hide a
+    // later access of another shard. The origin is stored after the time and is
+    // therefore best effort under concurrent updates of the same address.
+    uint64_t current = time.load(std::memory_order_relaxed);
+    while (current <= new_time) {
+        if (time.compare_exchange_weak(current, new_time, std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+            origin.store(new_origin, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+shadow_memory_t::access_result_t
+shadow_memory_t::on_read(int shard, uint64_t timestamp, uintptr_t addr, size_t size,
+                         uintptr_t pc)
+{
+    access_result_t result;
+    size = std::max<size_t>(size, 1);
+    note_line(shard, timestamp, addr, size, false);
+    uint64_t origin = make_origin(shard, pc);
+    for (uintptr_t granule = granule_of(addr), last = granule_of(addr + size - 1);;
+         granule++) {
+        granule_slot_t *slot = granules_.get(granule);
+        uint64_t write = slot->write_origin.load(std::memory_order_acquire);
+        if (!result.raw && write != 0 && origin_shard(write) != shard &&
+            slot->write_time.load(std::memory_order_acquire) <= timestamp) {
+            result.raw = true;
+            result.writer_shard = origin_shard(write);
+            result.writer_pc = origin_pc(write);
+            result.reader_shard = shard;
+            result.reader_pc = pc;
+        }
+        publish(slot->read_time, slot->read_origin, timestamp, origin);
+        // The end of the folded address space does not wrap around.
+        if (granule == last || granule == granule_of(ADDR_MASK))
+            break;
+    }
+    return result;
+}
+
+shadow_memory_t::access_result_t
+shadow_memory_t::on_write(int shard, uint64_t timestamp, uintptr_t addr, size_t size,
+                          uintptr_t pc)
+{
+    access_result_t result;
+    size = std::max<size_t>(size, 1);
+    note_line(shard, timestamp, addr, size, true);
+    uint64_t origin = make_origin(shard, pc);
+    for (uintptr_t granule = granule_of(addr), last = granule_of(addr + size - 1);;
+         granule++) {
+        granule_slot_t *slot = granules_.get(granule);
+        // The reader's shard may have been processed ahead of us: a read stamped
+        // later than this write, with no newer write in between, depends on it.
+        uint64_t read = slot->read_origin.load(std::memory_order_acquire);
+        if (!result.raw && read != 0 && origin_shard(read) != shard &&
+            slot->read_time.load(std::memory_order_acquire) >= timestamp &&
+            slot->write_time.load(std::memory_order_acquire) <= timestamp) {
+            result.raw = true;
+            result.writer_shard = shard;
+            result.writer_pc = pc;
+            result.reader_shard = origin_shard(read);
+            result.reader_pc = origin_pc(read);
+        }
+        publish(slot->write_time, slot->write_origin, timestamp, origin);
+        if (granule == last || granule == granule_of(ADDR_MASK))
+            break;
+    }
+    return result;
+}
+
+void
+shadow_memory_t::note_line(int shard, uint64_t timestamp, uintptr_t addr, size_t size,
+                           bool is_write)
+{
+    const uintptr_t line_size = uintptr_t(1) << CACHE_LINE_BITS;
+    // An access crossing lines counts on each of them with the part it covers.
+    size_t offset = addr & (line_size - 1);
+    if (offset + size > line_size) {
+        size_t head = line_size - offset;
+        note_line(shard, timestamp, addr + head, size - head, is_write);
+        size = head;
+    }
+    line_slot_t *slot = lines_.get(line_of(addr));
+    // The slot keeps the latest access in trace time. An access at or after it
+    // pairs with it and takes its place; an access before it belongs to a shard
+    // running behind and pairs with it from the earlier side, as on_write() does
+    // for a reader processed ahead.
+    uint64_t prev = slot->last.load(std::memory_order_acquire);
+    publish(slot->last_time, slot->last, timestamp,
+            pack_line_access(shard, offset, size, is_write));
+    if (prev == 0)
+        return;
+    int prev_shard = static_cast<int>(prev >> 32) - 1;
+    bool prev_write = (prev & 1) != 0;
+    if (prev_shard == shard || !(is_write || prev_write))
+        return;
+    size_t prev_offset = (prev >> 16) & 0xffff;
+    size_t prev_size = (prev >> 1) & 0x7fff;
+    if (offset < prev_offset + prev_size && prev_offset < offset + size)
+        slot->true_sharing.fetch_add(1, std::memory_order_relaxed);
+    else
+        slot->false_sharing.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<shadow_memory_t::line_stats_t>
+shadow_memory_t::hottest_lines(size_t count) const
+{
+    std::vector<line_stats_t> result;
+    lines_.for_each([&](uintptr_t line, const line_slot_t &slot) {
+        uint64_t true_sharing = slot.true_sharing.load(std::memory_order_relaxed);
+        uint64_t false_sharing = slot.false_sharing.load(std::memory_order_relaxed);
+        if (true_sharing + false_sharing != 0)
+            result.push_back({ line << CACHE_LINE_BITS, true_sharing, false_sharing });
+    });
+    std::sort(result.begin(), result.end(),
+              [](const line_stats_t &a, const line_stats_t &b) {
+                  return a.true_sharing + a.false_sharing >
+                      b.true_sharing + b.false_sharing;
+              });
+    if (result.size() > count)
+        result.resize(count);
+    return result;
+}
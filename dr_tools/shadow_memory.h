@@ -0,0 +1,229 @@
+#ifndef _SHADOW_MEMORY_H_
+#define _SHADOW_MEMORY_H_ 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// Shadow memory shared by all shards of a tool.
+/// Memory is tracked in aligned granules: every granule an access overlaps owns a
+/// slot with the timestamped last write and last read, and every cache line owns
+/// a slot with the timestamped last access and sharing counters. Slots live in lazily
+/// populated page tables that grow with the traced footprint. All updates are
+/// lock-free, so shards keep running in parallel; accesses are ordered by trace
+/// timestamps rather than by the order in which shards happen to process them.
+class shadow_memory_t {
+public:
+    /// Accesses closer than a granule are not told apart.
+    static constexpr unsigned int GRANULE_BITS = 2;
+    static constexpr unsigned int CACHE_LINE_BITS = 6;
+    /// Addresses are folded to the low ADDR_BITS bits.
+    static constexpr unsigned int ADDR_BITS = 48;
+
+    /// Inter-thread RAW dependence closed by an access.
+    struct access_result_t {
+        bool raw = false;
+        int writer_shard = -1;
+        uintptr_t writer_pc = 0;
+        int reader_shard = -1;
+        uintptr_t reader_pc = 0;
+    };
+
+    struct line_stats_t {
+        /// Address of the first byte of the cache line.
+        uintptr_t line;
+        /// Accesses from different threads touching the same bytes.
+        uint64_t true_sharing;
+        /// Accesses from different threads touching disjoint bytes of the line.
+        uint64_t false_sharing;
+    };
+
+    access_result_t
+    on_read(int shard, uint64_t timestamp, uintptr_t addr, size_t size, uintptr_t pc);
+    access_result_t
+    on_write(int shard, uint64_t timestamp, uintptr_t addr, size_t size, uintptr_t pc);
+
+    /// Cache lines with the most sharing events, hottest first.
+    std::vector<line_stats_t>
+    hottest_lines(size_t count) const;
+
+    /// Starts loading the slots of the first granule and line of an access to addr,
+    /// if they exist already.
+    inline void
+    prefetch(uintptr_t addr) const
+    {
+        const granule_slot_t *granule = granules_.find(granule_of(addr));
+        if (granule != nullptr)
+            __builtin_prefetch(granule);
+        const line_slot_t *line = lines_.find(line_of(addr));
+        if (line != nullptr)
+            __builtin_prefetch(line);
+    }
+
+private:
+    static constexpr uintptr_t ADDR_MASK = (uintptr_t(1) << ADDR_BITS) - 1;
+
+    /// The full trace time of an access is kept next to who made it, packed by
+    /// make_origin(); an origin of zero means "never".
+    struct granule_slot_t {
+        std::atomic<uint64_t> write_time{ 0 };
+        std::atomic<uint64_t> write_origin{ 0 };
+        std::atomic<uint64_t> read_time{ 0 };
+        std::atomic<uint64_t> read_origin{ 0 };
+    };
+
+    struct line_slot_t {
+        /// Trace time of the latest access.
+        std::atomic<uint64_t> last_time{ 0 };
+        /// Packed shard, offset, size and kind of the latest access.
+        std::atomic<uint64_t> last{ 0 };
+        std::atomic<uint64_t> true_sharing{ 0 };
+        std::atomic<uint64_t> false_sharing{ 0 };
+    };
+
+    /// Three-level page table over keys below 2^KEY_BITS. Leaves of slots and the
+    /// middle level are allocated on first touch and installed with a CAS.
+    template <typename slot_type, unsigned int KEY_BITS> class table_t {
+    public:
+        table_t()
+            : root_(new std::atomic<mid_t *>[ROOT_SIZE])
+        {
+            for (size_t i = 0; i < ROOT_SIZE; i++)
+                root_[i].store(nullptr, std::memory_order_relaxed);
+        }
+        ~table_t()
+        {
+            for (size_t i = 0; i < ROOT_SIZE; i++) {
+                mid_t *mid = root_[i].load(std::memory_order_relaxed);
+                if (mid == nullptr)
+                    continue;
+                for (size_t j = 0; j < MID_SIZE; j++)
+                    delete mid->leaves[j].load(std::memory_order_relaxed);
+                delete mid;
+            }
+        }
+        table_t(const table_t &) = delete;
+        table_t &
+        operator=(const table_t &) = delete;
+
+        /// The slot of key, allocating its leaf if needed.
+        slot_type *
+        get(uintptr_t key)
+        {
+            mid_t *mid = install(root_[(key >> (MID_BITS + LEAF_BITS)) & (ROOT_SIZE - 1)]);
+            leaf_t *leaf = install(mid->leaves[(key >> LEAF_BITS) & (MID_SIZE - 1)]);
+            return &leaf->slots[key & (LEAF_SIZE - 1)];
+        }
+
+        /// The slot of key, or null if it was never touched.
+        inline const slot_type *
+        find(uintptr_t key) const
+        {
+            mid_t *mid = root_[(key >> (MID_BITS + LEAF_BITS)) & (ROOT_SIZE - 1)].load(
+                std::memory_order_acquire);
+            if (mid == nullptr)
+                return nullptr;
+            leaf_t *leaf = mid->leaves[(key >> LEAF_BITS) & (MID_SIZE - 1)].load(
+                std::memory_order_acquire);
+            return leaf == nullptr ? nullptr : &leaf->slots[key & (LEAF_SIZE - 1)];
+        }
+
+        /// Calls func(key, slot) on every slot of the allocated leaves.
+        template <typename F>
+        void
+        for_each(F func) const
+        {
+            for (size_t i = 0; i < ROOT_SIZE; i++) {
+                mid_t *mid = root_[i].load(std::memory_order_acquire);
+                if (mid == nullptr)
+                    continue;
+                for (size_t j = 0; j < MID_SIZE; j++) {
+                    leaf_t *leaf = mid->leaves[j].load(std::memory_order_acquire);
+                    if (leaf == nullptr)
+                        continue;
+                    uintptr_t base = ((i << MID_BITS) | j) << LEAF_BITS;
+                    for (size_t k = 0; k < LEAF_SIZE; k++)
+                        func(base | k, leaf->slots[k]);
+                }
+            }
+        }
+
+    private:
+        static constexpr unsigned int LEAF_BITS = 12;
+        static constexpr unsigned int MID_BITS = 17;
+        static constexpr size_t LEAF_SIZE = size_t(1) << LEAF_BITS;
+        static constexpr size_t MID_SIZE = size_t(1) << MID_BITS;
+        static constexpr size_t ROOT_SIZE = size_t(1) << (KEY_BITS - MID_BITS - LEAF_BITS);
+
+        struct leaf_t {
+            slot_type slots[LEAF_SIZE];
+        };
+        struct mid_t {
+            mid_t()
+            {
+                for (size_t i = 0; i < MID_SIZE; i++)
+                    leaves[i].store(nullptr, std::memory_order_relaxed);
+            }
+            std::atomic<leaf_t *> leaves[MID_SIZE];
+        };
+
+        template <typename node_type>
+        static node_type *
+        install(std::atomic<node_type *> &entry)
+        {
+            node_type *node = entry.load(std::memory_order_acquire);
+            if (node != nullptr)
+                return node;
+            node_type *fresh = new node_type();
+            if (entry.compare_exchange_strong(node, fresh, std::memory_order_acq_rel))
+                return fresh;
+            // Another shard installed it first.
+            delete fresh;
+            return node;
+        }
+
+        std::unique_ptr<std::atomic<mid_t *>[]> root_;
+    };
+
+    /// An origin packs (shard + 1) above the pc folded to ADDR_BITS bits.
+    static inline uint64_t
+    make_origin(int shard, uintptr_t pc)
+    {
+        return (static_cast<uint64_t>(shard + 1) << ADDR_BITS) | (pc & ADDR_MASK);
+    }
+    static inline int
+    origin_shard(uint64_t origin)
+    {
+        return static_cast<int>(origin >> ADDR_BITS) - 1;
+    }
+    static inline uintptr_t
+    origin_pc(uint64_t origin)
+    {
+        return static_cast<uintptr_t>(origin & ADDR_MASK);
+    }
+
+    static inline uintptr_t
+    granule_of(uintptr_t addr)
+    {
+        return (addr & ADDR_MASK) >> GRANULE_BITS;
+    }
+    static inline uintptr_t
+    line_of(uintptr_t addr)
+    {
+        return (addr & ADDR_MASK) >> CACHE_LINE_BITS;
+    }
+
+    static void
+    publish(std::atomic<uint64_t> &time, std::atomic<uint64_t> &origin, uint64_t new_time,
+            uint64_t new_origin);
+
+    void
+    note_line(int shard, uint64_t timestamp, uintptr_t addr, size_t size, bool is_write);
+
+    table_t<granule_slot_t, ADDR_BITS - GRANULE_BITS> granules_;
+    table_t<line_slot_t, ADDR_BITS - CACHE_LINE_BITS> lines_;
+};
+
+#endif /* _SHADOW_MEMORY_H_ */
@@ -0,0 +1,138 @@
+
+#include <cstdio>
+#include <sstream>
+#include "snapshot.h"
+
+namespace {
+
+const char SNAPSHOT_MAGIC[] = "DRSNAP2";
+const uint64_t MAX_KIND_SIZE = 64;
+
+} // namespace
+
+constexpr uint64_t checkpoint_trigger_t::POLL_RECORDS;
+
+std::vector<std::string>
+checkpoint_options_t::merge_paths() const
+{
+    std::vector<std::string> paths;
+    std::stringstream ss(merge);
+    std::string path;
+    while (std::getline(ss, path, ',')) {
+        if (!path.empty())
+            paths.push_back(path);
+    }
+    return paths;
+}
+
+std::string
+checkpoint_options_t::validate() const
+{
+    if (interval > 0 && path.empty())
+        return "A checkpoint interval needs a checkpoint path";
+    return "";
+}
+
+snapshot_writer_t::snapshot_writer_t(const std::string &path, const std::string &kind)
+    : path_(path)
+    , tmp_path_(path + ".tmp")
+    , file_(gzopen(tmp_path_.c_str(), "wb6"))
+    , ok_(file_ != nullptr)
+{
+    if (!ok_)
+        return;
+    ok_ = gzwrite(file_, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) > 0;
+    put(kind.size());
+    if (ok_ && !kind.empty())
+        ok_ = gzwrite(file_, kind.data(), static_cast<unsigned>(kind.size())) > 0;
+}
+
+snapshot_writer_t::~snapshot_writer_t()
+{
+    if (file_ != nullptr) {
+        gzclose(file_);
+        std::remove(tmp_path_.c_str());
+    }
+}
+
+void
+snapshot_writer_t::put(uint64_t value)
+{
+    // LEB128: counts and small ids, which dominate the snapshots, take a byte.
+    unsigned char bytes[10];
+    int size = 0;
+    do {
+        bytes[size] = value & 0x7f;
+        value >>= 7;
+        if (value != 0)
+            bytes[size] |= 0x80;
+        size++;
+    } while (value != 0);
+    if (ok_)
+        ok_ = gzwrite(file_, bytes, size) == size;
+}
+
+std::string
+snapshot_writer_t::commit()
+{
+    if (file_ == nullptr)
+        return "Failed to create " + tmp_path_;
+    bool closed = gzclose(file_) == Z_OK;
+    file_ = nullptr;
+    if (!ok_ || !closed) {
+        std::remove(tmp_path_.c_str());
+        return "Failed to write " + tmp_path_;
+    }
+    if (std::rename(tmp_path_.c_str(), path_.c_str()) != 0)
+        return "Failed to rename " + tmp_path_ + " to " + path_;
+    return "";
+}
+
+snapshot_reader_t::~snapshot_reader_t()
+{
+    if (file_ != nullptr)
+        gzclose(file_);
+}
+
+std::string
+snapshot_reader_t::open(const std::string &path, const std::string &kind)
+{
+    file_ = gzopen(path.c_str(), "rb");
+    if (file_ == nullptr)
+        return "Failed to open snapshot " + path;
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    ok_ = gzread(file_, magic, sizeof(magic)) == sizeof(magic) &&
+        std::string(magic, sizeof(magic)) ==
+            std::string(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    if (!ok_)
+        return path + " is not a snapshot";
+    uint64_t kind_size = get();
+    if (!ok_ || kind_size > MAX_KIND_SIZE)
+        return path + " is not a " + kind + " snapshot";
+    std::string stored(kind_size, '\0');
+    ok_ = ok_ &&
+        (stored.empty() ||
+         gzread(file_, &stored[0], static_cast<unsigned>(stored.size())) ==
+             static_cast<int>(stored.size()));
+    if (!ok_ || stored != kind)
+        return path + " is not a " + kind + " snapshot";
+    return "";
+}
+
+uint64_t
+snapshot_reader_t::get()
+{
+    uint64_t value = 0;
+    for (int shift = 0; ok_ && shift < 64; shift += 7) {
+        int byte = gzgetc(file_);
+        if (byte < 0) {
+            ok_ = false;
+            break;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    ok_ = false;
+    return 0;
+}
@@ -0,0 +1,144 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_ 1
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+/// Checkpointing knobs shared by the tools.
+struct checkpoint_options_t {
+    /// Snapshot written here; no checkpoints if empty.
+    std::string path;
+    /// Records, over all the shards, between two snapshots; 0 writes only the
+    /// final one.
+    uint64_t interval = 0;
+    /// Snapshot of an earlier run over the same trace to continue from: its
+    /// state is restored and each shard skips the records it already covers.
+    std::string resume;
+    /// Comma-separated snapshots of other runs whose results are added to ours.
+    std::string merge;
+    /// cu_t: also save the per-shard dependence history, so that a resumed run
+    /// continues the dependences of the previous segment.
+    bool history = false;
+
+    std::vector<std::string>
+    merge_paths() const;
+    /// Returns an error string for a combination that cannot work, or "".
+    std::string
+    validate() const;
+};
+
+/// Decides from the records of all the shards when the next snapshot is due,
+/// so that a single shard writes it. Each snapshot starts an epoch, and every
+/// shard publishes its state once per epoch, when it next polls.
+class checkpoint_trigger_t {
+public:
+    explicit checkpoint_trigger_t(uint64_t interval)
+        : interval_(interval)
+    {
+    }
+
+    bool
+    enabled() const
+    {
+        return interval_ > 0;
+    }
+
+    /// Records a shard processes between two calls to add().
+    uint64_t
+    poll_records() const
+    {
+        return std::min(interval_, POLL_RECORDS);
+    }
+
+    /// Adds the records a shard processed since its last call. Returns true for
+    /// the one caller that starts a new epoch, which writes the snapshot.
+    bool
+    add(uint64_t records)
+    {
+        uint64_t due = (records_.fetch_add(records, std::memory_order_relaxed) + records) /
+            interval_;
+        uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+        return due > epoch && epoch_.compare_exchange_strong(epoch, due);
+    }
+
+    uint64_t
+    epoch() const
+    {
+        return epoch_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr uint64_t POLL_RECORDS = 4096;
+
+    uint64_t interval_;
+    std::atomic<uint64_t> records_{ 0 };
+    std::atomic<uint64_t> epoch_{ 0 };
+};
+
+/// Writes a zlib-compressed stream of varints. The data goes to a temporary
+/// file that replaces the snapshot only on commit(), so a crash while writing
+/// leaves the previous snapshot intact.
+class snapshot_writer_t {
+public:
+    snapshot_writer_t(const std::string &path, const std::string &kind);
+    ~snapshot_writer_t();
+
+    void
+    put(uint64_t value);
+
+    template <typename T>
+    void
+    put_ptr(T *ptr)
+    {
+        put(reinterpret_cast<uintptr_t>(ptr));
+    }
+
+    /// Returns an error string or "" on success.
+    std::string
+    commit();
+
+private:
+    std::string path_;
+    std::string tmp_path_;
+    gzFile file_;
+    bool ok_;
+};
+
+class snapshot_reader_t {
+public:
+    snapshot_reader_t() = default;
+    ~snapshot_reader_t();
+
+    /// Checks that the snapshot holds the state of the given kind of tool.
+    /// Returns an error string or "" on success.
+    std::string
+    open(const std::string &path, const std::string &kind);
+
+    /// Returns 0 once the stream is exhausted or corrupt; see ok().
+    uint64_t
+    get();
+
+    template <typename T>
+    T *
+    get_ptr()
+    {
+        return reinterpret_cast<T *>(static_cast<uintptr_t>(get()));
+    }
+
+    bool
+    ok() const
+    {
+        return ok_;
+    }
+
+private:
+    gzFile file_ = nullptr;
+    bool ok_ = false;
+};
+
+#endif /* _SNAPSHOT_H_ */
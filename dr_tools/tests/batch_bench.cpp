@@ -0,0 +1,155 @@
+// Throughput of the single-record path (batch_size 0) against the batched one,
+// on a synthetic trace fed to one shard through the virtual
+// parallel_shard_memref() calls the analyzer makes. Build it with the tools
+// against DynamoRIO's drmemtrace and run
+//   batch_bench [cfg|cu|cross] [records in millions] [data footprint in MB]
+// It prints the records per second of each batch size, best of RUNS runs.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "analysis_tool.h"
+#include "snapshot.h"
+
+analysis_tool_t *
+cfg_tool_create(const std::string &module_file_path, uint64_t skip_refs,
+                uint64_t sim_refs, const std::string &syntax, unsigned int verbose,
+                const std::string &alt_module_dir, const std::string &filter,
+                unsigned int chunk_workers, unsigned int batch_size,
+                const checkpoint_options_t &checkpoint, bool huge_pages);
+analysis_tool_t *
+cu_tool_create(const std::string &module_file_path, uint64_t skip_refs, uint64_t sim_refs,
+               const std::string &syntax, unsigned int verbose,
+               const std::string &alt_module_dir, bool cross_thread,
+               const std::string &filter, unsigned int batch_size,
+               const std::string &access_log_dir, const checkpoint_options_t &checkpoint,
+               bool huge_pages);
+
+namespace {
+
+/// Code of the synthetic trace: slot i is at CODE_BASE + 16 * i and i % 4 picks
+/// its kind; the slots form blocks of BLOCK_SLOTS entered at random.
+constexpr uintptr_t CODE_BASE = 0x400000;
+constexpr size_t CODE_SLOTS = 4096;
+constexpr size_t BLOCK_SLOTS = 8;
+constexpr uintptr_t DATA_BASE = 0x10000000;
+
+struct kind_t {
+    bool load;
+    bool store;
+    unsigned char size;
+    unsigned char encoding[3];
+};
+const kind_t KINDS[] = {
+    { false, false, 3, { 0x48, 0x01, 0xc8 } }, // add rax, rcx
+    { true, false, 3, { 0x48, 0x8b, 0x03 } },  // mov rax, [rbx]
+    { false, true, 3, { 0x48, 0x89, 0x03 } },  // mov [rbx], rax
+    { true, true, 3, { 0x48, 0x01, 0x03 } },   // add [rbx], rax
+};
+
+std::vector<memref_t>
+make_trace(size_t records, size_t footprint)
+{
+    std::mt19937_64 rng(1);
+    std::vector<memref_t> trace;
+    trace.reserve(records + 4);
+    uint64_t timestamp = 13400000000000000ULL;
+    size_t slot = 0;
+    while (trace.size() < records) {
+        if (trace.size() % 1024 == 0) {
+            memref_t marker = {};
+            marker.marker.type = TRACE_TYPE_MARKER;
+            marker.marker.tid = 1;
+            marker.marker.marker_type = TRACE_MARKER_TYPE_TIMESTAMP;
+            marker.marker.marker_value = timestamp++;
+            trace.push_back(marker);
+        }
+        if (slot % BLOCK_SLOTS == 0)
+            slot = (rng() % (CODE_SLOTS / BLOCK_SLOTS)) * BLOCK_SLOTS;
+        const kind_t &kind = KINDS[slot % 4];
+        uintptr_t pc = CODE_BASE + 16 * slot;
+        memref_t instr = {};
+        instr.instr.type = slot % BLOCK_SLOTS == BLOCK_SLOTS - 1
+            ? TRACE_TYPE_INSTR_DIRECT_JUMP
+            : TRACE_TYPE_INSTR;
+        instr.instr.tid = 1;
+        instr.instr.addr = pc;
+        instr.instr.size = kind.size;
+        std::memcpy(instr.instr.encoding, kind.encoding, kind.size);
+        trace.push_back(instr);
+        uintptr_t addr = DATA_BASE + (rng() % (footprint / 8)) * 8;
+        for (int access = 0; access < 2; access++) {
+            if (!(access == 0 ? kind.load : kind.store))
+                continue;
+            memref_t data = {};
+            data.data.type = access == 0 ? TRACE_TYPE_READ : TRACE_TYPE_WRITE;
+            data.data.tid = 1;
+            data.data.addr = addr;
+            data.data.size = 8;
+            data.data.pc = pc;
+            trace.push_back(data);
+        }
+        slot++;
+    }
+    return trace;
+}
+
+analysis_tool_t *
+create_tool(const std::string &tool, unsigned int batch_size)
+{
+    checkpoint_options_t none;
+    if (tool == "cfg")
+        return cfg_tool_create("", 0, 0, "", 0, "", "", 0, batch_size, none, false);
+    return cu_tool_create("", 0, 0, "", 0, "", tool == "cross", "", batch_size, "", none,
+                          false);
+}
+
+/// Seconds to feed the trace to a fresh shard and close it.
+double
+run(const std::string &tool_name, unsigned int batch_size,
+    const std::vector<memref_t> &trace)
+{
+    analysis_tool_t *tool = create_tool(tool_name, batch_size);
+    std::string error = tool->initialize_stream(nullptr);
+    if (!error.empty()) {
+        std::fprintf(stderr, "%s\n", error.c_str());
+        std::exit(1);
+    }
+    void *shard = tool->parallel_shard_init_stream(0, nullptr, nullptr);
+    auto start = std::chrono::steady_clock::now();
+    for (const memref_t &memref : trace)
+        tool->parallel_shard_memref(shard, memref);
+    tool->parallel_shard_exit(shard);
+    auto end = std::chrono::steady_clock::now();
+    delete tool;
+    return std::chrono::duration<double>(end - start).count();
+}
+
+} // namespace
+
+int
+main(int argc, char **argv)
+{
+    static constexpr int RUNS = 5;
+    std::string tool = argc > 1 ? argv[1] : "cu";
+    size_t records = (argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 4) * 1000000;
+    size_t footprint = (argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 64) << 20;
+    std::vector<memref_t> trace = make_trace(records, footprint);
+    std::printf("%s: %zu records, %zu MB of data\n", tool.c_str(), trace.size(),
+                footprint >> 20);
+    for (unsigned int batch_size : { 0, 16, 64, 256 }) {
+        double best = 1e30;
+        for (int i = 0; i < RUNS; i++)
+            best = std::min(best, run(tool, batch_size, trace));
+        std::printf("batch_size %3u: %7.2f Mrecords/s\n", batch_size,
+                    trace.size() / best / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+// Checks of the trace-time ordering of shadow_memory_t. Standalone:
+//   g++ -std=c++14 -I.. shadow_memory_test.cpp ../shadow_memory.cpp
+// exits with a non-zero status on a failure.
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include "shadow_memory.h"
+
+namespace {
+
+int failures = 0;
+
+void
+check(bool ok, const char *what, uint64_t base)
+{
+    if (!ok) {
+        std::fprintf(stderr, "FAIL: %s (base timestamp %llu)\n", what,
+                     static_cast<unsigned long long>(base));
+        failures++;
+    }
+}
+
+/// Shard 0 writes and shard 1 reads one address, in both processing orders and
+/// both trace orders; times are offsets from base.
+void
+check_orders(uint64_t base)
+{
+    shadow_memory_t shadow;
+    const uintptr_t WRITE_PC = 0x1000, READ_PC = 0x2000;
+
+    // The read happened first in the trace: no dependence either way.
+    uintptr_t addr = 0x10000;
+    check(!shadow.on_read(1, base + 1, addr, 8, READ_PC).raw &&
+              !shadow.on_write(0, base + 2, addr, 8, WRITE_PC).raw,
+          "read before write, reader processed first", base);
+    addr += 64;
+    check(!shadow.on_write(0, base + 2, addr, 8, WRITE_PC).raw &&
+              !shadow.on_read(1, base + 1, addr, 8, READ_PC).raw,
+          "read before write, writer processed first", base);
+
+    // The write happened first in the trace: a dependence either way.
+    addr += 64;
+    check(!shadow.on_write(0, base + 1, addr, 8, WRITE_PC).raw,
+          "write before read, writer processed first: write", base);
+    shadow_memory_t::access_result_t res = shadow.on_read(1, base + 2, addr, 8, READ_PC);
+    check(res.raw && res.writer_shard == 0 && res.writer_pc == WRITE_PC &&
+              res.reader_shard == 1 && res.reader_pc == READ_PC,
+          "write before read, writer processed first: read", base);
+    addr += 64;
+    check(!shadow.on_read(1, base + 2, addr, 8, READ_PC).raw,
+          "write before read, reader processed first: read", base);
+    res = shadow.on_write(0, base + 1, addr, 8, WRITE_PC);
+    check(res.raw && res.writer_shard == 0 && res.writer_pc == WRITE_PC &&
+              res.reader_shard == 1 && res.reader_pc == READ_PC,
+          "write before read, reader processed first: write", base);
+
+    // A thread reading its own write is not a cross-thread dependence.
+    addr += 64;
+    shadow.on_write(0, base + 1, addr, 8, WRITE_PC);
+    check(!shadow.on_read(0, base + 2, addr, 8, READ_PC).raw, "same thread", base);
+}
+
+/// The sharing counted on a line must not depend on which of two shards is
+/// processed first.
+void
+check_sharing(uint64_t base)
+{
+    for (int writer_first = 0; writer_first < 2; writer_first++) {
+        shadow_memory_t shadow;
+        const uintptr_t SAME = 0x40000, DISJOINT = 0x40040;
+        if (writer_first) {
+            shadow.on_write(0, base + 2, SAME, 8, 0x1000);
+            shadow.on_read(1, base + 1, SAME, 8, 0x2000);
+            shadow.on_write(0, base + 2, DISJOINT, 8, 0x1000);
+            shadow.on_read(1, base + 1, DISJOINT + 8, 8, 0x2000);
+        } else {
+            shadow.on_read(1, base + 1, SAME, 8, 0x2000);
+            shadow.on_write(0, base + 2, SAME, 8, 0x1000);
+            shadow.on_read(1, base + 1, DISJOINT + 8, 8, 0x2000);
+            shadow.on_write(0, base + 2, DISJOINT, 8, 0x1000);
+        }
+        // A shard running behind must not hide the latest write from the
+        // shards after it.
+        const uintptr_t BEHIND = 0x40080;
+        if (writer_first) {
+            shadow.on_write(0, base + 10, BEHIND, 8, 0x1000);
+            shadow.on_read(1, base + 1, BEHIND, 8, 0x2000);
+        } else {
+            shadow.on_read(1, base + 1, BEHIND, 8, 0x2000);
+            shadow.on_write(0, base + 10, BEHIND, 8, 0x1000);
+        }
+        shadow.on_read(2, base + 11, BEHIND, 8, 0x3000);
+        std::vector<shadow_memory_t::line_stats_t> lines = shadow.hottest_lines(3);
+        check(lines.size() == 3, "sharing: all lines", base);
+        for (const auto &line : lines) {
+            if (line.line == BEHIND) {
+                check(line.true_sharing == 2 && line.false_sharing == 0,
+                      "sharing: shard behind", base);
+            } else if (line.line == SAME) {
+                check(line.true_sharing == 1 && line.false_sharing == 0,
+                      "sharing: same bytes", base);
+            } else {
+                check(line.true_sharing == 0 && line.false_sharing == 1,
+                      "sharing: disjoint bytes", base);
+            }
+        }
+    }
+}
+
+} // namespace
+
+int
+main()
+{
+    check_orders(1);
+    // DR timestamps count microseconds since 1601, well above 2^48.
+    check_orders(13400000000000000ULL);
+    check_sharing(13400000000000000ULL);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+
+#include "work_stealing_pool.h"
+
+namespace {
+
+/// Pool and queue of the worker running on this thread, if any.
+thread_local const work_stealing_pool_t *current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+} // namespace
+
+work_stealing_pool_t::work_stealing_pool_t(unsigned int num_workers)
+{
+    if (num_workers == 0)
+        num_workers = 1;
+    for (unsigned int i = 0; i < num_workers; i++)
+        queues_.emplace_back(new queue_t());
+    for (unsigned int i = 0; i < num_workers; i++)
+        workers_.emplace_back(&work_stealing_pool_t::worker_loop, this, i);
+}
+
+work_stealing_pool_t::~work_stealing_pool_t()
+{
+    {
+        std::lock_guard<std::mutex> lg(sleep_mutex_);
+        done_.store(true, std::memory_order_release);
+    }
+    wake_.notify_all();
+    for (auto &worker : workers_)
+        worker.join();
+}
+
+void
+work_stealing_pool_t::submit(task_group_t &group, task_t task)
+{
+    group.pending_.fetch_add(1, std::memory_order_acq_rel);
+    // Workers keep what they spawn local; outside threads spread their tasks.
+    size_t index = current_pool == this
+        ? current_queue
+        : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    {
+        std::lock_guard<std::mutex> lg(queues_[index]->mutex);
+        queues_[index]->items.push_back({ &group, std::move(task) });
+    }
+    {
+        std::lock_guard<std::mutex> lg(sleep_mutex_);
+        queued_.fetch_add(1, std::memory_order_release);
+    }
+    wake_.notify_one();
+}
+
+bool
+work_stealing_pool_t::pop_or_steal(size_t self, item_t &item)
+{
+    {
+        queue_t &own = *queues_[self];
+        std::lock_guard<std::mutex> lg(own.mutex);
+        if (!own.items.empty()) {
+            item = std::move(own.items.back());
+            own.items.pop_back();
+            queued_.fetch_sub(1, std::memory_order_acq_rel);
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues_.size(); i++) {
+        queue_t &victim = *queues_[(self + i) % queues_.size()];
+        std::lock_guard<std::mutex> lg(victim.mutex);
+        if (!victim.items.empty()) {
+            item = std::move(victim.items.front());
+            victim.items.pop_front();
+            queued_.fetch_sub(1, std::memory_order_acq_rel);
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+work_stealing_pool_t::run(item_t &item)
+{
+    item.task();
+    item.group->pending_.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+bool
+work_stealing_pool_t::run_one()
+{
+    item_t item;
+    size_t self = current_pool == this ? current_queue : 0;
+    if (!pop_or_steal(self, item))
+        return false;
+    run(item);
+    return true;
+}
+
+void
+work_stealing_pool_t::wait(task_group_t &group)
+{
+    while (group.pending() > 0) {
+        if (!run_one())
+            std::this_thread::yield();
+    }
+}
+
+void
+work_stealing_pool_t::worker_loop(size_t index)
+{
+    current_pool = this;
+    current_queue = index;
+    while (true) {
+        item_t item;
+        if (pop_or_steal(index, item)) {
+            run(item);
+            continue;
+        }
+        std::unique_lock<std::mutex> ul(sleep_mutex_);
+        wake_.wait(ul, [this] {
+            return done_.load(std::memory_order_acquire) ||
+                queued_.load(std::memory_order_acquire) > 0;
+        });
+        if (done_.load(std::memory_order_acquire) &&
+            queued_.load(std::memory_order_acquire) == 0)
+            return;
+    }
+}
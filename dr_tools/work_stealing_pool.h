@@ -0,0 +1,81 @@
+#ifndef _WORK_STEALING_POOL_H_
+#define _WORK_STEALING_POOL_H_ 1
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Fixed set of worker threads, each with its own deque of tasks.
+/// A worker pops its newest task first and, once its deque is empty, steals the
+/// oldest task of another worker, so a burst of work submitted by one shard is
+/// spread over all otherwise idle workers.
+class work_stealing_pool_t {
+public:
+    using task_t = std::function<void()>;
+
+    /// Unfinished tasks submitted on behalf of one owner.
+    class task_group_t {
+    public:
+        size_t
+        pending() const
+        {
+            return pending_.load(std::memory_order_acquire);
+        }
+
+    private:
+        friend class work_stealing_pool_t;
+        std::atomic<size_t> pending_{ 0 };
+    };
+
+    explicit work_stealing_pool_t(unsigned int num_workers);
+    ~work_stealing_pool_t();
+
+    void
+    submit(task_group_t &group, task_t task);
+
+    /// Runs one queued task on the calling thread; false if there was none.
+    bool
+    run_one();
+
+    /// Helps with queued tasks until every task of the group has finished.
+    void
+    wait(task_group_t &group);
+
+    size_t
+    num_workers() const
+    {
+        return workers_.size();
+    }
+
+private:
+    struct item_t {
+        task_group_t *group;
+        task_t task;
+    };
+    struct queue_t {
+        std::mutex mutex;
+        std::deque<item_t> items;
+    };
+
+    bool
+    pop_or_steal(size_t self, item_t &item);
+    void
+    run(item_t &item);
+    void
+    worker_loop(size_t index);
+
+    std::vector<std::unique_ptr<queue_t>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<size_t> queued_{ 0 };
+    std::atomic<size_t> next_queue_{ 0 };
+    std::atomic<bool> done_{ false };
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+};
+
+#endif /* _WORK_STEALING_POOL_H_ */